@@ -16,13 +16,17 @@
 
 #include "llvm/ADT/iterator_range.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
 #include "llvm/ExecutionEngine/RuntimeDyld.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IRTransformLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
 #include "llvm/IR/DataLayout.h"
@@ -31,28 +35,176 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include <algorithm>
+#include <functional>
+#include <list>
 #include <memory>
+#include <set>
 #include <string>
 #include <vector>
 
+#include "memmgr.h"
+
 namespace llvm {
 namespace orc {
 
 class KaleidoscopeJIT {
 public:
+  typedef std::function<std::unique_ptr<Module>(std::unique_ptr<Module>)>
+      OptimizeFunction;
+  // Returns the TargetMachine to generate a module's code with, or null for
+  // the JIT's own.
+  typedef std::function<TargetMachine *(Module &)> SelectMachineFunction;
+
   typedef ObjectLinkingLayer<> ObjLayerT;
   typedef IRCompileLayer<ObjLayerT> CompileLayerT;
-  typedef CompileLayerT::ModuleSetHandleT ModuleHandleT;
+  typedef IRTransformLayer<CompileLayerT, OptimizeFunction> OptimizeLayerT;
+  typedef CompileOnDemandLayer<OptimizeLayerT> CODLayerT;
 
-  KaleidoscopeJIT()
-      : TM(EngineBuilder().selectTarget()), DL(TM->createDataLayout()),
-        CompileLayer(ObjectLayer, SimpleCompiler(*TM)) {
+  // A module lives either in the eager stack or behind the lazy layer,
+  // depending on how the JIT was created.
+  struct ModuleHandleT {
+    OptimizeLayerT::ModuleSetHandleT Eager;
+    CODLayerT::ModuleSetHandleT Lazy;
+  };
+
+  // Code is generated with Machine, which must target the host. Optimize
+  // runs on every module just before it is compiled. When Lazy is set, a
+  // module's functions are only given stubs when it is added; each one is
+  // extracted, optimized and compiled on its first call. With PoolMemory,
+  // modules share slabs of memory instead of mapping their own pages.
+  // SelectMachine may pick another host TargetMachine for some modules, which
+  // is then used on the thread adding them.
+  KaleidoscopeJIT(std::unique_ptr<TargetMachine> Machine, bool Lazy,
+                  bool PoolMemory, OptimizeFunction Optimize,
+                  SelectMachineFunction SelectMachine = nullptr)
+      : Lazy(Lazy), PoolMemory(PoolMemory), TM(std::move(Machine)),
+        DL(TM->createDataLayout()), SelectMachine(std::move(SelectMachine)),
+        CompileLayer(ObjectLayer,
+                     [this](Module &M) { return compileModule(M); }),
+        OptimizeLayer(CompileLayer, std::move(Optimize)),
+        CompileCallbackManager(
+            createLocalCompileCallbackManager(TM->getTargetTriple(), 0)),
+        CODLayer(OptimizeLayer,
+                 [](Function &F) { return std::set<Function *>({&F}); },
+                 *CompileCallbackManager,
+                 createLocalIndirectStubsManagerBuilder(
+                     TM->getTargetTriple())),
+        StubsMgr(createLocalIndirectStubsManagerBuilder(
+            TM->getTargetTriple())()) {
     llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
   }
 
   TargetMachine &getTargetMachine() { return *TM; }
 
+  // Makes a host function callable from JIT'd code under Name without a
+  // dynamic symbol lookup.
+  void addHostSymbol(const std::string &Name, void *Addr) {
+    HostSymbols[mangle(Name)] = (JITTargetAddress)(uintptr_t)Addr;
+  }
+
+  // Modules found in Cache are loaded from it instead of being compiled, and
+  // newly compiled ones are added to it.
+  void setObjectCache(ObjectCache *Cache) {
+    CompileLayer.setObjectCache(Cache);
+  }
+
+  // Adds a module that the caller will remove again, such as one holding an
+  // anonymous expression.
   ModuleHandleT addModule(std::unique_ptr<Module> M) {
+    auto H = addToLayer(std::move(M));
+    ModuleHandles.push_back(H);
+    return H;
+  }
+
+  void removeModule(ModuleHandleT H) {
+    ModuleHandles.erase(find_if(ModuleHandles, [&](const ModuleHandleT &I) {
+      return Lazy ? I.Lazy == H.Lazy : I.Eager == H.Eager;
+    }));
+    removeFromLayer(H);
+  }
+
+  // Adds a module of function definitions that stay live until they are
+  // redefined. Each external function is renamed to a versioned body and
+  // every use of its name, recursive calls included, goes through a stub.
+  // Redefining the function repoints the stub, so code compiled against the
+  // old body picks up the new one without being recompiled. A module whose
+  // bodies have all been replaced is retired, and freed by the next call to
+  // freeRetiredDefinitions().
+  void addDefinitions(std::unique_ptr<Module> M) {
+    std::vector<Function *> Bodies;
+    for (auto &F : *M)
+      if (!F.isDeclaration() && F.hasExternalLinkage())
+        Bodies.push_back(&F);
+
+    std::vector<std::pair<std::string, std::string>> Names;
+    for (auto *F : Bodies) {
+      std::string Name = F->getName();
+      std::string BodyName = (Name + "$" + Twine(NextVersion++)).str();
+
+      auto *Decl = Function::Create(F->getFunctionType(),
+                                    GlobalValue::ExternalLinkage, "", M.get());
+      F->setName(BodyName);
+      Decl->setName(Name);
+      F->replaceAllUsesWith(Decl);
+
+      Names.push_back(std::make_pair(mangle(Name), mangle(BodyName)));
+    }
+
+    Definitions.push_back(DefinitionSet{addToLayer(std::move(M)),
+                                        (unsigned)Names.size()});
+    auto Set = std::prev(Definitions.end());
+
+    // New names need their stubs before any body is linked, since the bodies
+    // call through them.
+    for (auto &N : Names)
+      if (!BodyOwners.count(N.first))
+        if (auto Err = StubsMgr->createStub(N.first, 0,
+                                            JITSymbolFlags::Exported))
+          report_fatal_error(std::move(Err));
+
+    for (auto &N : Names) {
+      // Eagerly compiled bodies are finalized here; a lazy body's address is
+      // its compile-on-demand stub, so nothing is compiled yet.
+      JITTargetAddress Addr = findSymbolInLayer(Set->H, N.second).getAddress();
+      if (auto Err = StubsMgr->updatePointer(N.first, Addr))
+        report_fatal_error(std::move(Err));
+
+      auto Owner = BodyOwners.find(N.first);
+      if (Owner != BodyOwners.end())
+        releaseDefinition(Owner->second);
+      BodyOwners[N.first] = Set;
+    }
+
+    if (Names.empty())
+      releaseDefinition(Set, 0);
+  }
+
+  // Frees retired definition modules. Only safe while no JIT'd code is
+  // running, since a retired body may still be on the stack.
+  void freeRetiredDefinitions() {
+    for (auto &H : Retired)
+      removeFromLayer(H);
+    Retired.clear();
+  }
+
+  JITSymbol findSymbol(const std::string Name) {
+    return findMangledSymbol(mangle(Name));
+  }
+
+private:
+  struct DefinitionSet {
+    ModuleHandleT H;
+    unsigned LiveBodies;
+  };
+
+  typedef std::list<DefinitionSet>::iterator DefinitionSetIt;
+
+  object::OwningBinary<object::ObjectFile> compileModule(Module &M) {
+    TargetMachine *Machine = SelectMachine ? SelectMachine(M) : nullptr;
+    return SimpleCompiler(Machine ? *Machine : *TM)(M);
+  }
+
+  ModuleHandleT addToLayer(std::unique_ptr<Module> M) {
     // We need a memory manager to allocate memory and resolve symbols for this
     // new module. Create one that resolves symbols by looking back into the
     // JIT.
@@ -63,24 +215,46 @@ public:
           return JITSymbol(nullptr);
         },
         [](const std::string &S) { return nullptr; });
-    auto H = CompileLayer.addModuleSet(singletonSet(std::move(M)),
-                                       make_unique<SectionMemoryManager>(),
-                                       std::move(Resolver));
 
-    ModuleHandles.push_back(H);
+    ModuleHandleT H;
+    if (Lazy)
+      H.Lazy = CODLayer.addModuleSet(singletonSet(std::move(M)),
+                                     createMemoryManager(),
+                                     std::move(Resolver));
+    else
+      H.Eager = OptimizeLayer.addModuleSet(singletonSet(std::move(M)),
+                                           createMemoryManager(),
+                                           std::move(Resolver));
     return H;
   }
 
-  void removeModule(ModuleHandleT H) {
-    ModuleHandles.erase(find(ModuleHandles, H));
-    CompileLayer.removeModuleSet(H);
+  std::unique_ptr<RTDyldMemoryManager> createMemoryManager() {
+    if (PoolMemory)
+      return make_unique<PooledMemoryManager>(Pool);
+    return make_unique<SectionMemoryManager>();
   }
 
-  JITSymbol findSymbol(const std::string Name) {
-    return findMangledSymbol(mangle(Name));
+  void removeFromLayer(ModuleHandleT H) {
+    if (Lazy)
+      CODLayer.removeModuleSet(H.Lazy);
+    else
+      OptimizeLayer.removeModuleSet(H.Eager);
+  }
+
+  JITSymbol findSymbolInLayer(ModuleHandleT H, const std::string &Name) {
+    if (Lazy)
+      return CODLayer.findSymbolIn(H.Lazy, Name, true);
+    return OptimizeLayer.findSymbolIn(H.Eager, Name, true);
+  }
+
+  void releaseDefinition(DefinitionSetIt Set, unsigned Count = 1) {
+    Set->LiveBodies -= Count;
+    if (Set->LiveBodies == 0) {
+      Retired.push_back(Set->H);
+      Definitions.erase(Set);
+    }
   }
 
-private:
   std::string mangle(const std::string &Name) {
     std::string MangledName;
     {
@@ -97,25 +271,50 @@ private:
   }
 
   JITSymbol findMangledSymbol(const std::string &Name) {
+    // Stubs always point at the newest definition.
+    if (auto Sym = StubsMgr->findStub(Name, true))
+      return Sym;
+
     // Search modules in reverse order: from last added to first added.
     // This is the opposite of the usual search order for dlsym, but makes more
     // sense in a REPL where we want to bind to the newest available definition.
     for (auto H : make_range(ModuleHandles.rbegin(), ModuleHandles.rend()))
-      if (auto Sym = CompileLayer.findSymbolIn(H, Name, true))
+      if (auto Sym = findSymbolInLayer(H, Name))
         return Sym;
 
     // If we can't find the symbol in the JIT, try looking in the host process.
-    if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name))
+    // Host symbols never move, so each is looked up only once.
+    auto Host = HostSymbols.find(Name);
+    if (Host != HostSymbols.end())
+      return JITSymbol(Host->second, JITSymbolFlags::Exported);
+
+    if (auto SymAddr = RTDyldMemoryManager::getSymbolAddressInProcess(Name)) {
+      HostSymbols[Name] = SymAddr;
       return JITSymbol(SymAddr, JITSymbolFlags::Exported);
+    }
 
     return nullptr;
   }
 
+  bool Lazy;
+  bool PoolMemory;
   std::unique_ptr<TargetMachine> TM;
   const DataLayout DL;
+  SelectMachineFunction SelectMachine;
+  // Outlives the layers, whose memory managers give their blocks back to it.
+  SlabPool Pool;
   ObjLayerT ObjectLayer;
   CompileLayerT CompileLayer;
+  OptimizeLayerT OptimizeLayer;
+  std::unique_ptr<JITCompileCallbackManager> CompileCallbackManager;
+  CODLayerT CODLayer;
+  std::unique_ptr<IndirectStubsManager> StubsMgr;
   std::vector<ModuleHandleT> ModuleHandles;
+  std::list<DefinitionSet> Definitions;
+  std::vector<ModuleHandleT> Retired;
+  StringMap<DefinitionSetIt> BodyOwners;
+  StringMap<JITTargetAddress> HostSymbols;
+  unsigned NextVersion = 0;
 };
 
 } // end namespace orc
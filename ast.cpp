@@ -1,66 +1,249 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constant.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/ErrorHandling.h"
 
 #include "ast.h"
+#include "compiler.h"
+#include "eval.h"
 #include "jit.h"
 #include "log.h"
+#include "memo.h"
 #include "parser.h"
 
 // ========================================================================
-// Code generation
+// Symbol tables
 // ========================================================================
 
-std::map<std::string, llvm::AllocaInst*> NamedValues;
-std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+PrototypeAST *addPrototype(const PrototypeAST &P) {
+    SymbolTables &S = TheCompiler->Symbols;
+    if (P.getName() >= S.FunctionProtos.size())
+        S.FunctionProtos.resize(P.getName() + 1);
+
+    PrototypeAST *&Slot = S.FunctionProtos[P.getName()];
+    if (!Slot || !Slot->isSameAs(P))
+        Slot = S.ProtoArena.make<PrototypeAST>(
+                P.getName(), S.ProtoArena.copy(P.getArgs()), P.isOperator(),
+                P.getBinaryPrecedence());
+    return Slot;
+}
+
+void ClearFunctionCache() { TheCompiler->Symbols.FunctionCache.clear(); }
+
+void ForgetKeptDefinitions() {
+    SymbolTables &S = TheCompiler->Symbols;
+    for (FunctionDef &Def : S.FunctionDefs)
+        Def.AST = nullptr;
+    S.BodyArena.reset();
+}
+
+static SymbolID getOperatorSymbol(SymbolID *Symbols, const char *Prefix,
+                                  char Op) {
+    SymbolID &ID = Symbols[(unsigned char)Op];
+    if (!ID)
+        ID = TheCompiler->Names.intern(std::string(Prefix) + Op);
+    return ID;
+}
+
+SymbolID getBinaryOpSymbol(char Op) {
+    return getOperatorSymbol(TheCompiler->Symbols.BinaryOpSymbols, "binary",
+                             Op);
+}
+
+SymbolID getUnaryOpSymbol(char Op) {
+    return getOperatorSymbol(TheCompiler->Symbols.UnaryOpSymbols, "unary",
+                             Op);
+}
 
-llvm::LLVMContext TheContext;
-llvm::IRBuilder<> Builder(TheContext);
+// Memory the copies in FunctionDefs may take before they are all dropped.
+static const size_t MaxKeptBodyBytes = 64 << 20;
+
+// Copies E and everything under it into A.
+static ExprAST *cloneExpr(ASTArena &A, ExprAST *E) {
+    if (!E)
+        return nullptr;
+
+    switch (E->getKind()) {
+    case ExprAST::EK_Number:
+        return A.make<NumberExprAST>(llvm::cast<NumberExprAST>(E)->getVal());
+    case ExprAST::EK_Variable:
+        return A.make<VariableExprAST>(
+                llvm::cast<VariableExprAST>(E)->getName());
+    case ExprAST::EK_Binary: {
+        // As in codegen, walk chains like a+b+c+... down the left operand
+        // with a loop so the depth doesn't grow with their length.
+        llvm::SmallVector<BinaryExprAST *, 16> Spine;
+        auto *B = llvm::cast<BinaryExprAST>(E);
+        while (true) {
+            Spine.push_back(B);
+            auto *Next = llvm::dyn_cast<BinaryExprAST>(B->getLHS());
+            if (!Next)
+                break;
+            B = Next;
+        }
+
+        ExprAST *L = cloneExpr(A, Spine.back()->getLHS());
+        for (auto I = Spine.rbegin(), IE = Spine.rend(); I != IE; ++I)
+            L = A.make<BinaryExprAST>((*I)->getOp(), L,
+                                      cloneExpr(A, (*I)->getRHS()));
+        return L;
+    }
+    case ExprAST::EK_Unary: {
+        auto *U = llvm::cast<UnaryExprAST>(E);
+        return A.make<UnaryExprAST>(U->getOpcode(),
+                                    cloneExpr(A, U->getOperand()));
+    }
+    case ExprAST::EK_Call: {
+        auto *C = llvm::cast<CallExprAST>(E);
+        llvm::SmallVector<ExprAST *, 8> Args;
+        for (ExprAST *Arg : C->getArgs())
+            Args.push_back(cloneExpr(A, Arg));
+        return A.make<CallExprAST>(C->getCallee(),
+                                   A.copy(llvm::makeArrayRef(Args)));
+    }
+    case ExprAST::EK_Var: {
+        auto *V = llvm::cast<VarExprAST>(E);
+        llvm::SmallVector<std::pair<SymbolID, ExprAST *>, 4> Vars;
+        for (auto &Var : V->getVarNames())
+            Vars.push_back(
+                    std::make_pair(Var.first, cloneExpr(A, Var.second)));
+        return A.make<VarExprAST>(A.copy(llvm::makeArrayRef(Vars)),
+                                  cloneExpr(A, V->getBody()));
+    }
+    case ExprAST::EK_If: {
+        auto *I = llvm::cast<IfExprAST>(E);
+        return A.make<IfExprAST>(cloneExpr(A, I->getCond()),
+                                 cloneExpr(A, I->getThen()),
+                                 cloneExpr(A, I->getElse()));
+    }
+    case ExprAST::EK_For: {
+        auto *F = llvm::cast<ForExprAST>(E);
+        return A.make<ForExprAST>(F->getVarName(), cloneExpr(A, F->getStart()),
+                                  cloneExpr(A, F->getEnd()),
+                                  cloneExpr(A, F->getStep()),
+                                  cloneExpr(A, F->getBody()));
+    }
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+char PrototypeAST::getOperatorName() const {
+    assert(isUnaryOp() || isBinaryOp());
+    return TheCompiler->Names.getName(Name).back();
+}
+
+// ========================================================================
+// Code generation
+// ========================================================================
 
 static llvm::AllocaInst *CreateEntryBlockAlloca(llvm::Function *TheFunction,
-                                          const std::string &VarName) {
+                                          SymbolID VarName) {
     llvm::IRBuilder<> TmpB(&TheFunction->getEntryBlock(),
                            TheFunction->getEntryBlock().begin());
-    return TmpB.CreateAlloca(llvm::Type::getDoubleTy(TheContext), 0, VarName.c_str());
+    return TmpB.CreateAlloca(TmpB.getDoubleTy(), 0,
+                             TheCompiler->Names.getName(VarName));
 }
 
-llvm::Function *getFunction(std::string Name) {
-    if (auto *F = TheModule->getFunction(Name))
-        return F;
+llvm::Function *getFunction(SymbolID Name) {
+    SymbolTables &S = TheCompiler->Symbols;
 
-    auto FI = FunctionProtos.find(Name);
-    if (FI != FunctionProtos.end())
-        return FI->second->codegen();
+    if (Name < S.FunctionCache.size() && S.FunctionCache[Name])
+        return S.FunctionCache[Name];
 
-    return nullptr;
+    llvm::Function *F =
+            TheCompiler->Module->getFunction(TheCompiler->Names.getName(Name));
+    if (!F && Name < S.FunctionProtos.size() && S.FunctionProtos[Name])
+        F = S.FunctionProtos[Name]->codegen();
+
+    if (F) {
+        if (Name >= S.FunctionCache.size())
+            S.FunctionCache.resize(Name + 1);
+        S.FunctionCache[Name] = F;
+    }
+    return F;
+}
+
+// Whether uses of the operator Name can generate its body in place of a
+// call: its definition is known and it isn't already being expanded. Under
+// the JIT an operator can be redefined like any function, so uses call it
+// through its stub instead.
+static bool canInlineOperator(SymbolID Name) {
+    SymbolTables &S = TheCompiler->Symbols;
+    if (TheJIT)
+        return false;
+    if (Name >= S.FunctionDefs.size() || !S.FunctionDefs[Name].AST)
+        return false;
+    return std::find(S.ExpandingOperators.begin(), S.ExpandingOperators.end(),
+                     Name) == S.ExpandingOperators.end();
+}
+
+// Generates the body of the operator Name with its parameters bound to Args,
+// in place of a call. The body was compiled once as a function, so every
+// variable it refers to is one of its parameters or its own locals.
+static llvm::Value *inlineOperator(SymbolID Name,
+                                   llvm::ArrayRef<llvm::Value *> Args) {
+    llvm::IRBuilder<> &Builder = TheCompiler->Builder;
+    SymbolTables &S = TheCompiler->Symbols;
+    ScopedBindings &NamedValues = S.NamedValues;
+    FunctionAST *Def = S.FunctionDefs[Name].AST;
+
+    llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
+    llvm::ArrayRef<SymbolID> Params = Def->getProto()->getArgs();
+
+    size_t Scope = NamedValues.mark();
+    for (unsigned i = 0, e = Params.size(); i != e; ++i) {
+        llvm::AllocaInst *Alloca =
+                CreateEntryBlockAlloca(TheFunction, Params[i]);
+        Builder.CreateStore(Args[i], Alloca);
+        NamedValues.bind(Params[i], Alloca);
+    }
+
+    S.ExpandingOperators.push_back(Name);
+    llvm::Value *V = Def->getBody()->codegen();
+    S.ExpandingOperators.pop_back();
+    NamedValues.popTo(Scope);
+    return V;
 }
 
 llvm::Value *NumberExprAST::codegen() {
-    return llvm::ConstantFP::get(TheContext, llvm::APFloat(Val));
+    return llvm::ConstantFP::get(TheCompiler->Context, llvm::APFloat(Val));
 }
 
 llvm::Value *VariableExprAST::codegen() {
-    llvm::Value *V = NamedValues[Name];
+    llvm::IRBuilder<> &Builder = TheCompiler->Builder;
+    ScopedBindings &NamedValues = TheCompiler->Symbols.NamedValues;
+
+    llvm::Value *V = NamedValues.lookup(Name);
     if (!V)
-        LogErrorV("unknown variable name");
+        return LogErrorV("unknown variable name");
 
-    return Builder.CreateLoad(V, Name.c_str());
+    return Builder.CreateLoad(V, TheCompiler->Names.getName(Name));
 }
 
 llvm::Value *VarExprAST::codegen() {
-    std::vector<llvm::AllocaInst *> OldBindings;
+    llvm::IRBuilder<> &Builder = TheCompiler->Builder;
+    llvm::LLVMContext &Ctx = TheCompiler->Context;
+    ScopedBindings &NamedValues = TheCompiler->Symbols.NamedValues;
+
+    size_t Scope = NamedValues.mark();
 
     llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
 
     for (unsigned i = 0, e = VarNames.size(); i != e; ++i) {
-        const std::string &VarName = VarNames[i].first;
-        ExprAST *Init = VarNames[i].second.get();
+        SymbolID VarName = VarNames[i].first;
+        ExprAST *Init = VarNames[i].second;
 
         llvm::Value *InitVal;
 
@@ -69,49 +252,158 @@ llvm::Value *VarExprAST::codegen() {
             if(!InitVal)
                 return nullptr;
         } else {
-            InitVal = llvm::ConstantFP::get(TheContext, llvm::APFloat(0.0));
+            InitVal = llvm::ConstantFP::get(Ctx, llvm::APFloat(0.0));
         }
 
         llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
         Builder.CreateStore(InitVal, Alloca);
 
-        OldBindings.push_back(NamedValues[VarName]);
-
-        NamedValues[VarName] = Alloca;
+        NamedValues.bind(VarName, Alloca);
     }
 
     llvm::Value *BodyVal = Body->codegen();
     if(!BodyVal)
         return nullptr;
 
-    for(unsigned i = 0, e = VarNames.size(); i != e; ++i)
-        NamedValues[VarNames[i].first] = OldBindings[i];
+    NamedValues.popTo(Scope);
 
     return BodyVal;
 }
 
-llvm::Value *BinaryExprAST::codegen() {
-    if(Op == '=') {
-        VariableExprAST *LHSE = static_cast<VariableExprAST*>(LHS.get());
-        if(!LHSE)
-            return LogErrorV("destination of '=' must be a variable");
+llvm::Value *BinaryExprAST::codegenAssign() {
+    llvm::IRBuilder<> &Builder = TheCompiler->Builder;
+    ScopedBindings &NamedValues = TheCompiler->Symbols.NamedValues;
 
-        llvm::Value *Val = RHS->codegen();
-        if(!Val)
-            return nullptr;
+    VariableExprAST *LHSE = llvm::dyn_cast<VariableExprAST>(LHS);
+    if(!LHSE)
+        return LogErrorV("destination of '=' must be a variable");
+
+    llvm::Value *Val = RHS->codegen();
+    if(!Val)
+        return nullptr;
+
+    llvm::Value *Variable = NamedValues.lookup(LHSE->getName());
+    if(!Variable)
+        return LogErrorV("Unknown variable name");
 
-        llvm::Value *Variable = NamedValues[LHSE->getName()];
-        if(!Variable)
-            return LogErrorV("Unknown variable name");
+    Builder.CreateStore(Val, Variable);
+    return Val;
+}
+
+llvm::Value *ExprAST::codegenCond() {
+    llvm::Value *V = codegen();
+    if (!V)
+        return nullptr;
+    return TheCompiler->Builder.CreateFCmpONE(
+            V, llvm::ConstantFP::get(V->getType(), 0.0), "tobool");
+}
 
-        Builder.CreateStore(Val, Variable);
-        return Val;
+static bool isComparison(int Op) {
+    switch (Op) {
+    case '<':
+    case '>':
+    case tok_eq:
+    case tok_ne:
+    case tok_le:
+    case tok_ge:
+        return true;
     }
+    return false;
+}
+
+static bool isLogical(int Op) { return Op == '&' || Op == '|'; }
+
+bool isBuiltinBinaryOp(int Op) {
+    switch (Op) {
+    case '=':
+    case '+':
+    case '-':
+    case '*':
+        return true;
+    }
+    return isComparison(Op) || isLogical(Op);
+}
+
+// Materializes a boolean as the 0.0 or 1.0 the language's values are.
+static llvm::Value *boolToDouble(llvm::Value *B) {
+    if (!B)
+        return nullptr;
+    llvm::IRBuilder<> &Builder = TheCompiler->Builder;
+    return Builder.CreateUIToFP(B, Builder.getDoubleTy(), "booltmp");
+}
+
+// Compares L with this node's RHS. The orderings are unordered, as '<'
+// always was, so a > b stays the same as b < a when either is NaN.
+llvm::Value *BinaryExprAST::codegenCompare(llvm::Value *L) {
+    llvm::IRBuilder<> &Builder = TheCompiler->Builder;
 
-    llvm::Value *L = LHS->codegen();
     llvm::Value *R = RHS->codegen();
+    if (!R)
+        return nullptr;
+
+    switch (Op) {
+    case '<':
+        return Builder.CreateFCmpULT(L, R, "cmptmp");
+    case '>':
+        return Builder.CreateFCmpUGT(L, R, "cmptmp");
+    case tok_le:
+        return Builder.CreateFCmpULE(L, R, "cmptmp");
+    case tok_ge:
+        return Builder.CreateFCmpUGE(L, R, "cmptmp");
+    case tok_eq:
+        return Builder.CreateFCmpOEQ(L, R, "cmptmp");
+    default:
+        return Builder.CreateFCmpUNE(L, R, "cmptmp");
+    }
+}
+
+// Combines the condition L with this node's RHS, which is only evaluated if
+// L doesn't already decide the result.
+llvm::Value *BinaryExprAST::codegenLogical(llvm::Value *L) {
+    llvm::IRBuilder<> &Builder = TheCompiler->Builder;
+    llvm::LLVMContext &Ctx = TheCompiler->Context;
+    bool IsAnd = Op == '&';
+
+    llvm::BasicBlock *LHSBB = Builder.GetInsertBlock();
+    llvm::Function *TheFunction = LHSBB->getParent();
+    llvm::BasicBlock *RHSBB =
+            llvm::BasicBlock::Create(Ctx, IsAnd ? "and.rhs" : "or.rhs",
+                                     TheFunction);
+    llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(
+            Ctx, IsAnd ? "and.end" : "or.end");
+
+    if (IsAnd)
+        Builder.CreateCondBr(L, RHSBB, MergeBB);
+    else
+        Builder.CreateCondBr(L, MergeBB, RHSBB);
 
-    if (!R || !L)
+    Builder.SetInsertPoint(RHSBB);
+    llvm::Value *R = RHS->codegenCond();
+    if (!R)
+        return nullptr;
+    Builder.CreateBr(MergeBB);
+    RHSBB = Builder.GetInsertBlock();
+
+    TheFunction->getBasicBlockList().push_back(MergeBB);
+    Builder.SetInsertPoint(MergeBB);
+    llvm::PHINode *PN = Builder.CreatePHI(Builder.getInt1Ty(), 2,
+                                          IsAnd ? "andtmp" : "ortmp");
+    PN->addIncoming(Builder.getInt1(!IsAnd), LHSBB);
+    PN->addIncoming(R, RHSBB);
+    return PN;
+}
+
+llvm::Value *BinaryExprAST::codegenWithLHS(llvm::Value *L) {
+    llvm::IRBuilder<> &Builder = TheCompiler->Builder;
+
+    if (isComparison(Op))
+        return boolToDouble(codegenCompare(L));
+    if (isLogical(Op))
+        return boolToDouble(codegenLogical(Builder.CreateFCmpONE(
+                L, llvm::ConstantFP::get(L->getType(), 0.0), "tobool")));
+
+    llvm::Value *R = RHS->codegen();
+    if (!R)
         return nullptr;
 
     switch (Op) {
@@ -121,27 +413,86 @@ llvm::Value *BinaryExprAST::codegen() {
         return Builder.CreateFSub(L, R, "subtmp");
     case '*':
         return Builder.CreateFMul(L, R, "multmp");
-    case '<':
-        L = Builder.CreateFCmpULT(L, R, "cmptmp");
-        return Builder.CreateUIToFP(L, llvm::Type::getDoubleTy(TheContext),
-                                    "booltmp");
     default:
         break;
     }
 
-    llvm::Function *F = getFunction(std::string("binary") + Op);
+    SymbolID OpName = getBinaryOpSymbol(Op);
+    llvm::Value *Ops[2] = {L, R};
+    if (canInlineOperator(OpName))
+        return inlineOperator(OpName, Ops);
+
+    llvm::Function *F = getFunction(OpName);
     assert(F && "binary operator not found");
 
-    llvm::Value *Ops[2] = {L, R};
     return Builder.CreateCall(F, Ops, "binop");
 }
 
+llvm::Value *BinaryExprAST::codegen() {
+    if(Op == '=')
+        return codegenAssign();
+    if (isLogical(Op))
+        return boolToDouble(codegenCond());
+
+    // Chains like a+b+c+... or a<b<c<... nest down the left operand. Walk
+    // that spine with a loop so codegen depth doesn't grow with the length
+    // of the chain.
+    llvm::SmallVector<BinaryExprAST *, 16> Spine;
+    BinaryExprAST *E = this;
+    while (true) {
+        Spine.push_back(E);
+        auto *Next = llvm::dyn_cast<BinaryExprAST>(E->LHS);
+        if (!Next || Next->Op == '=')
+            break;
+        E = Next;
+    }
+
+    llvm::Value *L = Spine.back()->LHS->codegen();
+    for (auto I = Spine.rbegin(), IE = Spine.rend(); L && I != IE; ++I)
+        L = (*I)->codegenWithLHS(L);
+    return L;
+}
+
+llvm::Value *BinaryExprAST::codegenCond() {
+    // Only this comparison is kept as i1; a chain under it goes through
+    // codegen()'s loop.
+    if (isComparison(Op)) {
+        llvm::Value *L = LHS->codegen();
+        return L ? codegenCompare(L) : nullptr;
+    }
+    if (!isLogical(Op))
+        return ExprAST::codegenCond();
+
+    // Like codegen(), walk chains such as a&b&c&... with a loop, keeping
+    // the intermediate results as i1.
+    llvm::SmallVector<BinaryExprAST *, 16> Spine;
+    BinaryExprAST *E = this;
+    while (true) {
+        Spine.push_back(E);
+        auto *Next = llvm::dyn_cast<BinaryExprAST>(E->LHS);
+        if (!Next || !isLogical(Next->Op))
+            break;
+        E = Next;
+    }
+
+    llvm::Value *L = Spine.back()->LHS->codegenCond();
+    for (auto I = Spine.rbegin(), IE = Spine.rend(); L && I != IE; ++I)
+        L = (*I)->codegenLogical(L);
+    return L;
+}
+
 llvm::Value *UnaryExprAST::codegen() {
+    llvm::IRBuilder<> &Builder = TheCompiler->Builder;
+
     llvm::Value *OperandV = Operand->codegen();
     if (!OperandV)
         return nullptr;
 
-    llvm::Function *F = getFunction(std::string("unary") + Opcode);
+    SymbolID OpName = getUnaryOpSymbol(Opcode);
+    if (canInlineOperator(OpName))
+        return inlineOperator(OpName, OperandV);
+
+    llvm::Function *F = getFunction(OpName);
     if (!F)
         return LogErrorV("Unknown unary operator");
 
@@ -149,6 +500,8 @@ llvm::Value *UnaryExprAST::codegen() {
 }
 
 llvm::Value *CallExprAST::codegen() {
+    llvm::IRBuilder<> &Builder = TheCompiler->Builder;
+
     llvm::Function *CalleeF = getFunction(Callee);
     if (!CalleeF)
         return LogErrorV("unknown function referenced");
@@ -167,75 +520,152 @@ llvm::Value *CallExprAST::codegen() {
 }
 
 llvm::Function *PrototypeAST::codegen() {
+    llvm::LLVMContext &Ctx = TheCompiler->Context;
+
     std::vector<llvm::Type *> Doubles(Args.size(),
-                                      llvm::Type::getDoubleTy(TheContext));
+                                      llvm::Type::getDoubleTy(Ctx));
 
     llvm::FunctionType *FT = llvm::FunctionType::get(
-            llvm::Type::getDoubleTy(TheContext), Doubles, false);
+            llvm::Type::getDoubleTy(Ctx), Doubles, false);
 
     llvm::Function *F = llvm::Function::Create(
-            FT, llvm::Function::ExternalLinkage, Name, TheModule.get());
+            FT, llvm::Function::ExternalLinkage,
+            TheCompiler->Names.getName(Name), TheCompiler->Module.get());
 
     unsigned Idx = 0;
     for (auto &Arg : F->args())
-        Arg.setName(Args[Idx++]);
+        Arg.setName(TheCompiler->Names.getName(Args[Idx++]));
 
     return F;
 }
 
 llvm::Function *FunctionAST::codegen() {
-    auto &P = *Proto;
-    FunctionProtos[Proto->getName()] = std::move(Proto);
+    llvm::IRBuilder<> &Builder = TheCompiler->Builder;
+    llvm::LLVMContext &Ctx = TheCompiler->Context;
+    SymbolTables &S = TheCompiler->Symbols;
+    ScopedBindings &NamedValues = S.NamedValues;
+
+    auto &P = *addPrototype(*Proto);
     llvm::Function *TheFunction = getFunction(P.getName());
 
     if (!TheFunction)
         return nullptr;
 
-    if (P.isBinaryOp())
-        BinopPrecedence[P.getOperatorName()] = P.getBinaryPrecedence();
+    if (TheFunction->arg_size() != P.getArgs().size()) {
+        LogErrorV("redefinition with a different number of arguments");
+        return nullptr;
+    }
+
+    if (P.isBinaryOp()) {
+        int *Precedence = TheCompiler->Parse.BinopPrecedence;
+        Precedence[(unsigned char)P.getOperatorName()] =
+                P.getBinaryPrecedence();
+    }
+
+    // Uses are expanded in place outside the JIT; what remains are
+    // recursive calls and calls from other modules.
+    if (P.isOperator())
+        TheFunction->addFnAttr(llvm::Attribute::AlwaysInline);
 
     llvm::BasicBlock *BB =
-            llvm::BasicBlock::Create(TheContext, "entry", TheFunction);
+            llvm::BasicBlock::Create(Ctx, "entry", TheFunction);
     Builder.SetInsertPoint(BB);
 
-    NamedValues.clear();
+    size_t Scope = NamedValues.mark();
 
+    unsigned Idx = 0;
     for (auto &Arg : TheFunction->args()) {
-        llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, Arg.getName());
+        SymbolID ArgName = P.getArgs()[Idx++];
+        llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, ArgName);
 
         Builder.CreateStore(&Arg, Alloca);
 
-        NamedValues[Arg.getName()] = Alloca;
+        NamedValues.bind(ArgName, Alloca);
     }
 
-    if (llvm::Value *RetVal = Body->codegen()) {
+    // Uses of the operator in its own body are recursive calls, not uses of
+    // an earlier definition.
+    if (P.isOperator())
+        S.ExpandingOperators.push_back(P.getName());
+    llvm::Value *RetVal = Body->codegen();
+    if (P.isOperator())
+        S.ExpandingOperators.pop_back();
+    // Also drops whatever a failed nested scope left bound.
+    NamedValues.popTo(Scope);
+
+    if (RetVal) {
         Builder.CreateRet(RetVal);
 
+        // Top-level expressions are never called again. A body is only
+        // kept if it can be evaluated or expanded in place, neither of
+        // which happens under the JIT, where it may be redefined.
+        bool Pure = false, Recursive = false;
+        if (TheCompiler->Names.getName(P.getName()) != "__anon_expr") {
+            Pure = isPureDefinition(*this, &Recursive);
+            if (P.getName() >= S.FunctionDefs.size())
+                S.FunctionDefs.resize(P.getName() + 1);
+            FunctionDef &Def = S.FunctionDefs[P.getName()];
+            if (TheJIT) {
+                ForgetMemoizedResults(TheCompiler->Names.getName(P.getName()),
+                                      Def.Pure, Pure);
+                // Callers of a pure function that stops being pure aren't
+                // pure any more, and they aren't tracked.
+                if (Def.Pure && !Pure)
+                    for (FunctionDef &Other : S.FunctionDefs)
+                        Other.Pure = false;
+            }
+            Def.Pure = Pure;
+            Def.AST = nullptr;
+            if (!TheJIT && (Pure || P.isOperator())) {
+                // Redefinitions leave their old copies behind, so start
+                // over once the copies outgrow the cap.
+                if (S.BodyArena.getTotalMemory() >= MaxKeptBodyBytes)
+                    ForgetKeptDefinitions();
+                Def.AST = S.BodyArena.make<FunctionAST>(
+                        &P, cloneExpr(S.BodyArena, Body));
+            }
+        }
+
+        // Only pure functions can reuse earlier results, and only recursive
+        // ones are likely to see the same arguments again. Operators are
+        // expanded in place, so calls to them never reach a table.
+        llvm::Function *Impl = nullptr;
+        if (TheCompiler->MemoEntries && Pure && Recursive &&
+            !P.isOperator() && !P.getArgs().empty())
+            Impl = MemoizeFunction(*TheFunction, TheCompiler->MemoEntries);
+
         llvm::verifyFunction(*TheFunction);
+        if (Impl)
+            llvm::verifyFunction(*Impl);
 
-        // TheFPM->run(*TheFunction);
+        if (TheCompiler->FPM) {
+            TheCompiler->FPM->run(*TheFunction);
+            if (Impl)
+                TheCompiler->FPM->run(*Impl);
+        }
 
         return TheFunction;
     }
 
     TheFunction->eraseFromParent();
+    S.FunctionCache[P.getName()] = nullptr;
     return nullptr;
 }
 
 llvm::Value *IfExprAST::codegen() {
-    llvm::Value *CondV = Cond->codegen();
+    llvm::IRBuilder<> &Builder = TheCompiler->Builder;
+    llvm::LLVMContext &Ctx = TheCompiler->Context;
+
+    llvm::Value *CondV = Cond->codegenCond();
     if (!CondV)
         return nullptr;
 
-    CondV = Builder.CreateFCmpONE(
-            CondV, llvm::ConstantFP::get(TheContext, llvm::APFloat(0.0)), "ifcond");
-
     llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
 
     llvm::BasicBlock *ThenBB =
-            llvm::BasicBlock::Create(TheContext, "then", TheFunction);
-    llvm::BasicBlock *ElseBB = llvm::BasicBlock::Create(TheContext, "else");
-    llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(TheContext, "ifcont");
+            llvm::BasicBlock::Create(Ctx, "then", TheFunction);
+    llvm::BasicBlock *ElseBB = llvm::BasicBlock::Create(Ctx, "else");
+    llvm::BasicBlock *MergeBB = llvm::BasicBlock::Create(Ctx, "ifcont");
 
     Builder.CreateCondBr(CondV, ThenBB, ElseBB);
 
@@ -264,7 +694,7 @@ llvm::Value *IfExprAST::codegen() {
     Builder.SetInsertPoint(MergeBB);
 
     llvm::PHINode *PN =
-            Builder.CreatePHI(llvm::Type::getDoubleTy(TheContext), 2, "iftmp");
+            Builder.CreatePHI(llvm::Type::getDoubleTy(Ctx), 2, "iftmp");
 
     PN->addIncoming(ThenV, ThenBB);
     PN->addIncoming(ElseV, ElseBB);
@@ -272,7 +702,229 @@ llvm::Value *IfExprAST::codegen() {
     return PN;
 }
 
+// Whether evaluating E may assign to a variable called Name. Assignments to
+// other variables that shadow it count too.
+static bool mayAssign(ExprAST *E, SymbolID Name) {
+    llvm::SmallVector<ExprAST *, 16> Worklist;
+    Worklist.push_back(E);
+    while (!Worklist.empty()) {
+        E = Worklist.pop_back_val();
+        switch (E->getKind()) {
+        case ExprAST::EK_Number:
+        case ExprAST::EK_Variable:
+            break;
+        case ExprAST::EK_Binary: {
+            auto *B = llvm::cast<BinaryExprAST>(E);
+            if (B->getOp() == '=')
+                if (auto *V = llvm::dyn_cast<VariableExprAST>(B->getLHS()))
+                    if (V->getName() == Name)
+                        return true;
+            Worklist.push_back(B->getLHS());
+            Worklist.push_back(B->getRHS());
+            break;
+        }
+        case ExprAST::EK_Unary:
+            Worklist.push_back(llvm::cast<UnaryExprAST>(E)->getOperand());
+            break;
+        case ExprAST::EK_Call:
+            for (ExprAST *Arg : llvm::cast<CallExprAST>(E)->getArgs())
+                Worklist.push_back(Arg);
+            break;
+        case ExprAST::EK_Var: {
+            auto *V = llvm::cast<VarExprAST>(E);
+            for (auto &Var : V->getVarNames())
+                if (Var.second)
+                    Worklist.push_back(Var.second);
+            Worklist.push_back(V->getBody());
+            break;
+        }
+        case ExprAST::EK_If: {
+            auto *I = llvm::cast<IfExprAST>(E);
+            Worklist.push_back(I->getCond());
+            Worklist.push_back(I->getThen());
+            Worklist.push_back(I->getElse());
+            break;
+        }
+        case ExprAST::EK_For: {
+            auto *F = llvm::cast<ForExprAST>(E);
+            Worklist.push_back(F->getStart());
+            Worklist.push_back(F->getEnd());
+            if (F->getStep())
+                Worklist.push_back(F->getStep());
+            Worklist.push_back(F->getBody());
+            break;
+        }
+        }
+    }
+    return false;
+}
+
+// Doubles represent every integer up to this magnitude exactly.
+static const double MaxExactInteger = 9007199254740992.0;
+
+// Whether E is a literal integer that a double and an i64 hold alike.
+static bool getExactInteger(ExprAST *E, int64_t &Val) {
+    auto *N = llvm::dyn_cast<NumberExprAST>(E);
+    if (!N || N->getVal() != std::floor(N->getVal()) ||
+        std::fabs(N->getVal()) > MaxExactInteger)
+        return false;
+    Val = (int64_t)N->getVal();
+    return true;
+}
+
+// For the end condition "i < Limit" (or "i <= Limit" if Inclusive) with i an
+// integer stepping up by StepVal, the integer B such that i < B gives the
+// same answer. That only holds while every i tested, up to B + StepVal, is
+// exact as a double; past that the double loop rounds i. A constant limit
+// for which it doesn't hold gives null. Otherwise B is clamped to the exactly
+// representable range and Fits is set to whether it holds at run time.
+static llvm::Value *emitCountBound(llvm::Value *Limit, bool Inclusive,
+                                   int64_t StepVal, llvm::Value *&Fits) {
+    llvm::IRBuilder<> &Builder = TheCompiler->Builder;
+    llvm::Type *IntTy = Builder.getInt64Ty();
+    double MaxBound = MaxExactInteger - StepVal;
+
+    Fits = nullptr;
+    if (auto *C = llvm::dyn_cast<llvm::ConstantFP>(Limit)) {
+        double D = C->getValueAPF().convertToDouble();
+        D = Inclusive ? std::floor(D) + 1 : std::ceil(D);
+        if (!(D <= MaxBound))
+            return nullptr;
+        D = std::max(-MaxExactInteger, D);
+        return llvm::ConstantInt::get(IntTy, (int64_t)D, true);
+    }
+
+    llvm::Type *DoubleTy = Builder.getDoubleTy();
+    llvm::Value *Max = llvm::ConstantFP::get(DoubleTy, MaxExactInteger);
+    llvm::Value *Min = llvm::ConstantFP::get(DoubleTy, -MaxExactInteger);
+    llvm::Function *Round = llvm::Intrinsic::getDeclaration(
+            Builder.GetInsertBlock()->getModule(),
+            Inclusive ? llvm::Intrinsic::floor : llvm::Intrinsic::ceil,
+            DoubleTy);
+
+    llvm::Value *B = Builder.CreateCall(Round, Limit, "bound");
+    if (Inclusive)
+        B = Builder.CreateFAdd(B, llvm::ConstantFP::get(DoubleTy, 1.0));
+    Fits = Builder.CreateFCmpOLE(B, llvm::ConstantFP::get(DoubleTy, MaxBound),
+                                 "fits");
+    B = Builder.CreateSelect(Builder.CreateFCmpUGE(B, Max), Max, B);
+    B = Builder.CreateSelect(Builder.CreateFCmpOLT(B, Min), Min, B);
+    return Builder.CreateFPToSI(B, IntTy, "bound");
+}
+
+// The X of an end condition "VarName < X" or "VarName <= X" when X is a
+// literal or a variable the loop doesn't assign, so it can be evaluated once
+// before the loop.
+ExprAST *ForExprAST::getInvariantLimit() const {
+    auto *Cond = llvm::dyn_cast<BinaryExprAST>(End);
+    if (!Cond || (Cond->getOp() != '<' && Cond->getOp() != tok_le))
+        return nullptr;
+    auto *Var = llvm::dyn_cast<VariableExprAST>(Cond->getLHS());
+    if (!Var || Var->getName() != VarName)
+        return nullptr;
+
+    ExprAST *Limit = Cond->getRHS();
+    if (llvm::isa<NumberExprAST>(Limit))
+        return Limit;
+    if (auto *V = llvm::dyn_cast<VariableExprAST>(Limit))
+        if (V->getName() != VarName && !mayAssign(Body, V->getName()))
+            return Limit;
+    return nullptr;
+}
+
+// Lowers a loop whose variable starts at and steps by integer constants and
+// is never assigned in the loop. The variable is counted in an i64 induction
+// variable and converted to a double for the body. With a positive step and
+// an invariant "VarName < X" or "VarName <= X" end condition, the exit test
+// is an integer compare against a bound computed up front, so the trip count
+// is known on entry, as long as the bound is small enough for the double
+// loop to count exactly up to it.
+llvm::Value *ForExprAST::codegenCounted(int64_t StartVal, int64_t StepVal) {
+    llvm::IRBuilder<> &Builder = TheCompiler->Builder;
+    llvm::LLVMContext &Ctx = TheCompiler->Context;
+    ScopedBindings &NamedValues = TheCompiler->Symbols.NamedValues;
+    llvm::Type *IntTy = Builder.getInt64Ty();
+
+    llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
+
+    llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+
+    llvm::Value *Bound = nullptr, *Fits = nullptr;
+    if (StepVal > 0) {
+        if (ExprAST *Limit = getInvariantLimit()) {
+            llvm::Value *LimitVal = Limit->codegen();
+            if (!LimitVal)
+                return nullptr;
+            bool Inclusive =
+                    llvm::cast<BinaryExprAST>(End)->getOp() == tok_le;
+            Bound = emitCountBound(LimitVal, Inclusive, StepVal, Fits);
+        }
+    }
+
+    llvm::BasicBlock *PreheaderBB = Builder.GetInsertBlock();
+    llvm::BasicBlock *LoopBB =
+            llvm::BasicBlock::Create(Ctx, "loop", TheFunction);
+    Builder.CreateBr(LoopBB);
+    Builder.SetInsertPoint(LoopBB);
+
+    llvm::PHINode *IV = Builder.CreatePHI(IntTy, 2, "iv");
+    IV->addIncoming(llvm::ConstantInt::get(IntTy, StartVal, true),
+                    PreheaderBB);
+    llvm::Value *CurVar = Builder.CreateSIToFP(
+            IV, Builder.getDoubleTy(), TheCompiler->Names.getName(VarName));
+    Builder.CreateStore(CurVar, Alloca);
+
+    size_t Scope = NamedValues.mark();
+    NamedValues.bind(VarName, Alloca);
+
+    if (!Body->codegen())
+        return nullptr;
+
+    llvm::Value *Inc = llvm::ConstantInt::get(IntTy, StepVal, true);
+    llvm::Value *EndCond, *NextVar;
+    if (Bound && !Fits) {
+        EndCond = Builder.CreateICmpSLT(IV, Bound, "loopcond");
+        // The bound fits, so IV never passes 2^53 and this can't overflow.
+        NextVar = Builder.CreateNSWAdd(IV, Inc, "nextvar");
+    } else if (Bound) {
+        // Use the bound only when it turns out to fit.
+        llvm::Value *Cond = End->codegenCond();
+        if (!Cond)
+            return nullptr;
+        EndCond = Builder.CreateSelect(
+                Fits, Builder.CreateICmpSLT(IV, Bound), Cond, "loopcond");
+        NextVar = Builder.CreateAdd(IV, Inc, "nextvar");
+    } else {
+        EndCond = End->codegenCond();
+        if (!EndCond)
+            return nullptr;
+        NextVar = Builder.CreateAdd(IV, Inc, "nextvar");
+    }
+    IV->addIncoming(NextVar, Builder.GetInsertBlock());
+
+    llvm::BasicBlock *AfterBB =
+            llvm::BasicBlock::Create(Ctx, "afterloop", TheFunction);
+
+    Builder.CreateCondBr(EndCond, LoopBB, AfterBB);
+
+    Builder.SetInsertPoint(AfterBB);
+
+    NamedValues.popTo(Scope);
+
+    return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(Ctx));
+}
+
 llvm::Value *ForExprAST::codegen() {
+    int64_t StartInt, StepInt = 1;
+    if (getExactInteger(Start, StartInt) &&
+        (!Step || (getExactInteger(Step, StepInt) && StepInt != 0)) &&
+        !mayAssign(End, VarName) && !mayAssign(Body, VarName))
+        return codegenCounted(StartInt, StepInt);
+
+    llvm::IRBuilder<> &Builder = TheCompiler->Builder;
+    llvm::LLVMContext &Ctx = TheCompiler->Context;
+    ScopedBindings &NamedValues = TheCompiler->Symbols.NamedValues;
+
     llvm::Function *TheFunction = Builder.GetInsertBlock()->getParent();
 
     llvm::AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
@@ -284,12 +936,12 @@ llvm::Value *ForExprAST::codegen() {
     Builder.CreateStore(StartVal, Alloca);
 
     llvm::BasicBlock *LoopBB =
-            llvm::BasicBlock::Create(TheContext, "loop", TheFunction);
+            llvm::BasicBlock::Create(Ctx, "loop", TheFunction);
     Builder.CreateBr(LoopBB);
     Builder.SetInsertPoint(LoopBB);
 
-    llvm::AllocaInst *OldVal = NamedValues[VarName];
-    NamedValues[VarName] = Alloca;
+    size_t Scope = NamedValues.mark();
+    NamedValues.bind(VarName, Alloca);
 
     if (!Body->codegen())
         return nullptr;
@@ -300,32 +952,26 @@ llvm::Value *ForExprAST::codegen() {
         if (!StepVal)
             return nullptr;
     } else {
-        StepVal = llvm::ConstantFP::get(TheContext, llvm::APFloat(1.0));
+        StepVal = llvm::ConstantFP::get(Ctx, llvm::APFloat(1.0));
     }
 
-    llvm::Value *EndCond = End->codegen();
+    llvm::Value *EndCond = End->codegenCond();
     if (!EndCond)
         return nullptr;
 
-    llvm::Value *CurVar = Builder.CreateLoad(Alloca, VarName.c_str());
+    llvm::Value *CurVar =
+            Builder.CreateLoad(Alloca, TheCompiler->Names.getName(VarName));
     llvm::Value *NextVar = Builder.CreateFAdd(CurVar, StepVal, "nextvar");
     Builder.CreateStore(NextVar, Alloca);
 
-    EndCond = Builder.CreateFCmpONE(
-            EndCond, llvm::ConstantFP::get(TheContext, llvm::APFloat(0.0)),
-            "loopcond");
-
     llvm::BasicBlock *AfterBB =
-            llvm::BasicBlock::Create(TheContext, "afterloop", TheFunction);
+            llvm::BasicBlock::Create(Ctx, "afterloop", TheFunction);
 
     Builder.CreateCondBr(EndCond, LoopBB, AfterBB);
 
     Builder.SetInsertPoint(AfterBB);
 
-    if (OldVal)
-        NamedValues[VarName] = OldVal;
-    else
-        NamedValues.erase(VarName);
+    NamedValues.popTo(Scope);
 
-    return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(TheContext));
+    return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(Ctx));
 }
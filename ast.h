@@ -4,19 +4,70 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Value.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Casting.h"
 
 #include "KaleidoscopeJIT.h"
 
 #include "jit.h"
+#include "lexer.h"
 
-extern llvm::LLVMContext TheContext;
-extern std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
+// ========================================================================
+// AST allocation
+// ========================================================================
+
+// Bump allocator for AST nodes, argument lists and prototypes. Nodes are
+// never destroyed one by one: the arena is reset in one shot, so nothing
+// allocated here may own other memory.
+class ASTArena {
+    llvm::BumpPtrAllocator Alloc;
+
+public:
+    template <typename T, typename... ArgTs> T *make(ArgTs &&... Args) {
+        void *Mem = Alloc.Allocate(sizeof(T), alignof(T));
+        return new (Mem) T(std::forward<ArgTs>(Args)...);
+    }
+
+    template <typename T> llvm::ArrayRef<T> copy(llvm::ArrayRef<T> Elts) {
+        if (Elts.empty())
+            return llvm::ArrayRef<T>();
+        T *Mem = Alloc.Allocate<T>(Elts.size());
+        std::uninitialized_copy(Elts.begin(), Elts.end(), Mem);
+        return llvm::ArrayRef<T>(Mem, Elts.size());
+    }
+
+    void reset() { Alloc.Reset(); }
+    size_t getTotalMemory() const { return Alloc.getTotalMemory(); }
+};
+
+// Records P as the current prototype for its name, copying it out of the
+// current instance's AST arena if it differs from the one already known.
+PrototypeAST *addPrototype(const PrototypeAST &P);
+
+// Forgets the llvm::Function cached for each symbol. Called whenever the
+// current instance's module is replaced.
+void ClearFunctionCache();
+
+// Drops the definitions kept in FunctionDefs and frees their memory. Later
+// uses of those functions are compiled as plain calls.
+void ForgetKeptDefinitions();
+
+// Whether Op is one of the binary operators the language builds in, which
+// user definitions can't replace.
+bool isBuiltinBinaryOp(int Op);
+// SymbolIDs of the functions implementing the user-defined operator Op.
+SymbolID getBinaryOpSymbol(char Op);
+SymbolID getUnaryOpSymbol(char Op);
 
 // ========================================================================
 // Abstract Syntax Tree
@@ -24,138 +75,281 @@ extern std::map<std::string, std::unique_ptr<PrototypeAST>> FunctionProtos;
 
 class ExprAST {
 public:
+    enum ExprKind {
+        EK_Number,
+        EK_Variable,
+        EK_Binary,
+        EK_Unary,
+        EK_Call,
+        EK_Var,
+        EK_If,
+        EK_For
+    };
+
+private:
+    const ExprKind Kind;
+
+public:
+    ExprAST(ExprKind Kind) : Kind(Kind) {}
     virtual ~ExprAST() = default;
+
+    ExprKind getKind() const { return Kind; }
     virtual llvm::Value *codegen() = 0;
+    // Generates the expression as a branch condition: an i1 that is true if
+    // the value is nonzero. Comparisons and '&'/'|' produce it directly,
+    // without a round trip through double.
+    virtual llvm::Value *codegenCond();
 };
 
 class NumberExprAST : public ExprAST {
     double Val;
 
 public:
-    NumberExprAST(double Val) : Val(Val) {}
+    NumberExprAST(double Val) : ExprAST(EK_Number), Val(Val) {}
 
     llvm::Value *codegen() override;
+    double getVal() const { return Val; }
+
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Number; }
 };
 
 class VariableExprAST : public ExprAST {
-    std::string Name;
+    SymbolID Name;
 
 public:
-    VariableExprAST(const std::string &Name) : Name(Name) {}
+    VariableExprAST(SymbolID Name) : ExprAST(EK_Variable), Name(Name) {}
 
     llvm::Value *codegen() override;
-    const std::string &getName() const { return Name; }
+    SymbolID getName() const { return Name; }
+
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Variable; }
 };
 
 class BinaryExprAST : public ExprAST {
-    char Op;
-    std::unique_ptr<ExprAST> LHS, RHS;
+    // An ASCII operator character or a two-character comparison token.
+    int Op;
+    ExprAST *LHS, *RHS;
+
+    llvm::Value *codegenAssign();
+    llvm::Value *codegenWithLHS(llvm::Value *L);
+    llvm::Value *codegenCompare(llvm::Value *L);
+    llvm::Value *codegenLogical(llvm::Value *L);
 
 public:
-    BinaryExprAST(char op, std::unique_ptr<ExprAST> LHS,
-                  std::unique_ptr<ExprAST> RHS)
-            : Op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+    BinaryExprAST(int op, ExprAST *LHS, ExprAST *RHS)
+            : ExprAST(EK_Binary), Op(op), LHS(LHS), RHS(RHS) {}
 
     llvm::Value *codegen() override;
+    llvm::Value *codegenCond() override;
+    int getOp() const { return Op; }
+    ExprAST *getLHS() const { return LHS; }
+    ExprAST *getRHS() const { return RHS; }
+
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Binary; }
 };
 
 class UnaryExprAST : public ExprAST {
     char Opcode;
-    std::unique_ptr<ExprAST> Operand;
+    ExprAST *Operand;
 
 public:
-    UnaryExprAST(char Opcode, std::unique_ptr<ExprAST> Operand)
-            : Opcode(Opcode), Operand(std::move(Operand)) {}
+    UnaryExprAST(char Opcode, ExprAST *Operand)
+            : ExprAST(EK_Unary), Opcode(Opcode), Operand(Operand) {}
 
     llvm::Value *codegen() override;
+    char getOpcode() const { return Opcode; }
+    ExprAST *getOperand() const { return Operand; }
+
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Unary; }
 };
 
 class CallExprAST : public ExprAST {
-    std::string Callee;
-    std::vector<std::unique_ptr<ExprAST>> Args;
+    SymbolID Callee;
+    llvm::ArrayRef<ExprAST *> Args;
 
 public:
-    CallExprAST(const std::string &Callee,
-                std::vector<std::unique_ptr<ExprAST>> Args)
-            : Callee(Callee), Args(std::move(Args)) {}
+    CallExprAST(SymbolID Callee, llvm::ArrayRef<ExprAST *> Args)
+            : ExprAST(EK_Call), Callee(Callee), Args(Args) {}
 
     llvm::Value *codegen() override;
+    SymbolID getCallee() const { return Callee; }
+    llvm::ArrayRef<ExprAST *> getArgs() const { return Args; }
+
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Call; }
 };
 
 class VarExprAST : public ExprAST {
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
-    std::unique_ptr<ExprAST> Body;
+    llvm::ArrayRef<std::pair<SymbolID, ExprAST *>> VarNames;
+    ExprAST *Body;
 
 public:
 
-    VarExprAST(std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames,
-               std::unique_ptr<ExprAST> Body)
-        : VarNames(std::move(VarNames)), Body(std::move(Body)) {}
+    VarExprAST(llvm::ArrayRef<std::pair<SymbolID, ExprAST *>> VarNames,
+               ExprAST *Body)
+        : ExprAST(EK_Var), VarNames(VarNames), Body(Body) {}
 
     llvm::Value *codegen() override;
+    llvm::ArrayRef<std::pair<SymbolID, ExprAST *>> getVarNames() const {
+        return VarNames;
+    }
+    ExprAST *getBody() const { return Body; }
+
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_Var; }
 };
 
 class PrototypeAST {
-    std::string Name;
-    std::vector<std::string> Args;
+    SymbolID Name;
+    llvm::ArrayRef<SymbolID> Args;
     bool IsOperator;
     unsigned Precedence;
 
 public:
-    PrototypeAST(const std::string &name, std::vector<std::string> Args,
+    PrototypeAST(SymbolID name, llvm::ArrayRef<SymbolID> Args,
                  bool IsOperator = false, unsigned Prec = 0)
-            : Name(name), Args(std::move(Args)), IsOperator(IsOperator),
+            : Name(name), Args(Args), IsOperator(IsOperator),
                 Precedence(Prec) {}
 
     llvm::Function *codegen();
-    const std::string &getName() const { return Name; }
+    SymbolID getName() const { return Name; }
+    llvm::ArrayRef<SymbolID> getArgs() const { return Args; }
 
+    bool isOperator() const { return IsOperator; }
     bool isUnaryOp() const { return IsOperator && Args.size() == 1; }
     bool isBinaryOp() const { return IsOperator && Args.size() == 2; }
 
-    char getOperatorName() const {
-        assert(isUnaryOp() || isBinaryOp());
-        return Name[Name.size() - 1];
-    }
+    char getOperatorName() const;
 
     unsigned getBinaryPrecedence() const { return Precedence; }
+
+    bool isSameAs(const PrototypeAST &Other) const {
+        return Name == Other.Name && Args == Other.Args &&
+               IsOperator == Other.IsOperator &&
+               Precedence == Other.Precedence;
+    }
 };
 
 class FunctionAST {
-    std::unique_ptr<PrototypeAST> Proto;
-    std::unique_ptr<ExprAST> Body;
+    PrototypeAST *Proto;
+    ExprAST *Body;
 
 public:
-    FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-                std::unique_ptr<ExprAST> Body)
-            : Proto(std::move(Proto)), Body(std::move(Body)) {}
+    FunctionAST(PrototypeAST *Proto, ExprAST *Body)
+            : Proto(Proto), Body(Body) {}
 
     llvm::Function *codegen();
+    PrototypeAST *getProto() const { return Proto; }
+    ExprAST *getBody() const { return Body; }
+    void setBody(ExprAST *B) { Body = B; }
 };
 
 class IfExprAST : public ExprAST {
-    std::unique_ptr<ExprAST> Cond, Then, Else;
+    ExprAST *Cond, *Then, *Else;
 
 public:
-    IfExprAST(std::unique_ptr<ExprAST> Cond, std::unique_ptr<ExprAST> Then,
-              std::unique_ptr<ExprAST> Else)
-            : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
+    IfExprAST(ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+            : ExprAST(EK_If), Cond(Cond), Then(Then), Else(Else) {}
 
     llvm::Value *codegen() override;
+    ExprAST *getCond() const { return Cond; }
+    ExprAST *getThen() const { return Then; }
+    ExprAST *getElse() const { return Else; }
+
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_If; }
 };
 
 class ForExprAST : public ExprAST {
-    std::string VarName;
-    std::unique_ptr<ExprAST> Start, End, Step, Body;
+    SymbolID VarName;
+    ExprAST *Start, *End, *Step, *Body;
+
+    llvm::Value *codegenCounted(int64_t StartVal, int64_t StepVal);
+    ExprAST *getInvariantLimit() const;
 
 public:
-    ForExprAST(const std::string &VarName, std::unique_ptr<ExprAST> Start,
-               std::unique_ptr<ExprAST> End, std::unique_ptr<ExprAST> Step,
-               std::unique_ptr<ExprAST> Body)
-            : VarName(VarName), Start(std::move(Start)), End(std::move(End)),
-                Step(std::move(Step)), Body(std::move(Body)) {}
+    ForExprAST(SymbolID VarName, ExprAST *Start, ExprAST *End,
+               ExprAST *Step, ExprAST *Body)
+            : ExprAST(EK_For), VarName(VarName), Start(Start), End(End),
+                Step(Step), Body(Body) {}
 
     llvm::Value *codegen() override;
+    SymbolID getVarName() const { return VarName; }
+    ExprAST *getStart() const { return Start; }
+    ExprAST *getEnd() const { return End; }
+    // Null if the loop steps by 1.
+    ExprAST *getStep() const { return Step; }
+    ExprAST *getBody() const { return Body; }
+
+    static bool classof(const ExprAST *E) { return E->getKind() == EK_For; }
+};
+
+// ========================================================================
+// Symbol tables
+// ========================================================================
+
+// Variable bindings indexed by SymbolID. Binding a name saves the binding it
+// shadows, so leaving a scope is a pop back to the mark taken on entry.
+class ScopedBindings {
+    std::vector<llvm::AllocaInst *> Values;
+    std::vector<std::pair<SymbolID, llvm::AllocaInst *>> Shadowed;
+
+public:
+    llvm::AllocaInst *lookup(SymbolID Name) const {
+        return Name < Values.size() ? Values[Name] : nullptr;
+    }
+
+    void bind(SymbolID Name, llvm::AllocaInst *V) {
+        if (Name >= Values.size())
+            Values.resize(Name + 1);
+        Shadowed.push_back(std::make_pair(Name, Values[Name]));
+        Values[Name] = V;
+    }
+
+    size_t mark() const { return Shadowed.size(); }
+
+    void popTo(size_t Mark) {
+        while (Shadowed.size() > Mark) {
+            Values[Shadowed.back().first] = Shadowed.back().second;
+            Shadowed.pop_back();
+        }
+    }
+};
+
+// What is known about a function's last successfully compiled definition.
+struct FunctionDef {
+    // A copy of the definition, kept outside the JIT for pure functions and
+    // operators only.
+    FunctionAST *AST = nullptr;
+    // The function calls only itself and other pure functions, so a call
+    // has no effect but its result.
+    bool Pure = false;
+};
+
+// The code generator's tables for one CompilerInstance.
+struct SymbolTables {
+    // Current prototype for each function name, indexed by SymbolID.
+    std::vector<PrototypeAST *> FunctionProtos;
+    // Definitions indexed by SymbolID. Uses of a user operator generate its
+    // body in place, and pure calls with constant arguments are evaluated
+    // while simplifying the AST.
+    std::vector<FunctionDef> FunctionDefs;
+    // Operators whose bodies are being generated, innermost last. A use of
+    // one of these is a recursive call and stays a call.
+    llvm::SmallVector<SymbolID, 4> ExpandingOperators;
+    // Prototypes recorded in FunctionProtos live as long as the instance.
+    ASTArena ProtoArena;
+    // Definitions recorded in FunctionDefs, until ForgetKeptDefinitions().
+    ASTArena BodyArena;
+
+    // The llvm::Function in the module for each SymbolID, filled in on first
+    // use.
+    std::vector<llvm::Function *> FunctionCache;
+
+    ScopedBindings NamedValues;
+
+    // SymbolIDs of the "binary<op>" and "unary<op>" functions, interned on
+    // first use. Zero means not yet interned; it is the ID of a keyword,
+    // never of an operator function.
+    SymbolID BinaryOpSymbols[256] = {};
+    SymbolID UnaryOpSymbols[256] = {};
 };
 
 #endif // KALEIDOSCOPE_AST_H
@@ -0,0 +1,19 @@
+#include "compiler.h"
+
+// ========================================================================
+// Compiler instance
+// ========================================================================
+
+thread_local CompilerInstance *TheCompiler;
+
+void InitializeBinopPrecedence(Parser &P) {
+    P.BinopPrecedence['='] = 2;
+    P.BinopRightAssoc['='] = true;
+    P.BinopPrecedence['|'] = 5;
+    P.BinopPrecedence['&'] = 6;
+    P.BinopPrecedence['<'] = 10;
+    P.BinopPrecedence['>'] = 10;
+    P.BinopPrecedence['+'] = 20;
+    P.BinopPrecedence['-'] = 20;
+    P.BinopPrecedence['*'] = 40;
+}
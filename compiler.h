@@ -0,0 +1,84 @@
+#ifndef KALEIDOSCOPE_COMPILER_H
+#define KALEIDOSCOPE_COMPILER_H
+
+#include <cstdint>
+#include <memory>
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include "ast.h"
+#include "lexer.h"
+#include "parser.h"
+
+// ========================================================================
+// Compiler instance
+// ========================================================================
+
+// Everything one compilation owns: its identifiers, AST and parser, its
+// LLVMContext and module, and the code generator's symbol tables. The
+// parser, code generator and Handle*() functions work on the instance
+// current on the calling thread, so separate instances can compile on
+// separate threads. TheJIT is shared, and guarded by TheJITMutex.
+class CompilerInstance {
+public:
+    CompilerInstance() : Parse(Names, AST), Builder(Context) {}
+
+    Interner Names;
+    // Nodes of the top-level item being parsed; reset once it is code
+    // generated.
+    ASTArena AST;
+    Parser Parse;
+
+    llvm::LLVMContext Context;
+    llvm::IRBuilder<> Builder;
+    SymbolTables Symbols;
+    std::unique_ptr<llvm::Module> Module;
+    // Runs on each function as it is emitted. Null under the JIT, which
+    // optimizes modules itself as it compiles them.
+    std::unique_ptr<llvm::legacy::FunctionPassManager> FPM;
+
+    // Set by InitializeCodeGen(); the instance doesn't own the target.
+    llvm::TargetMachine *TM = nullptr;
+    unsigned OptLevel = 0;
+    std::unique_ptr<llvm::legacy::PassManager> MPM;
+
+    // Whether to simplify each item's AST before generating code for it,
+    // and how many steps evaluating pure calls may take in all for one item
+    // (0 never evaluates calls).
+    bool SimplifyAST = true;
+    uint64_t EvalBudget = 100000;
+
+    // Slots in the result table of each memoized function, a power of two;
+    // 0 memoizes nothing.
+    unsigned MemoEntries = 0;
+
+    // Errors reported while parsing and generating code.
+    unsigned NumErrors = 0;
+
+    // Whether to prompt for input and echo each item's IR on stderr, as the
+    // REPL does.
+    bool Interactive = true;
+};
+
+// The instance the compiler works on in this thread.
+extern thread_local CompilerInstance *TheCompiler;
+
+// Makes an instance current on this thread for the lifetime of the scope.
+class CompilerScope {
+    CompilerInstance *Prev;
+
+public:
+    explicit CompilerScope(CompilerInstance &CI) : Prev(TheCompiler) {
+        TheCompiler = &CI;
+    }
+    ~CompilerScope() { TheCompiler = Prev; }
+};
+
+// Installs the default operator precedences in P.
+void InitializeBinopPrecedence(Parser &P);
+
+#endif // KALEIDOSCOPE_COMPILER_H
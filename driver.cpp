@@ -4,30 +4,331 @@
 #include <windows.h>
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <thread>
+#include <vector>
 
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/IR/LLVMContext.h"
-#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/TargetSelect.h"
 
 #include "ast.h"
+#include "compiler.h"
+#include "emit.h"
 #include "jit.h"
+#include "lexer.h"
+#include "memo.h"
 #include "parser.h"
+#include "target.h"
+#include "tier.h"
 
 // ========================================================================
 // Driver
 // ========================================================================
 
-static void MainLoop() {
+static llvm::cl::opt<std::string> InputFilename(llvm::cl::Positional,
+                                                llvm::cl::desc("<input file>"),
+                                                llvm::cl::init("-"));
+
+// Pass timings and the executed pass list are available through LLVM's own
+// -time-passes and -debug-pass=Executions.
+static llvm::cl::opt<char>
+        OptLevel("O",
+                 llvm::cl::desc("Optimization level. [-O0, -O1, -O2, or -O3] "
+                                "(default = '-O2')"),
+                 llvm::cl::Prefix, llvm::cl::ZeroOrMore, llvm::cl::init('2'));
+
+static llvm::cl::opt<bool>
+        UseJIT("jit",
+               llvm::cl::desc("Execute top-level expressions with the JIT "
+                              "instead of writing output.o"));
+
+static llvm::cl::opt<bool>
+        Lazy("lazy",
+             llvm::cl::desc("With -jit, compile each function on its first "
+                            "call instead of when it is defined"));
+
+static llvm::cl::opt<bool>
+        PoolMemory("jit-pool-memory",
+                   llvm::cl::desc("Pack JIT'd modules into shared slabs. "
+                                  "Code slabs stay writable and executable "
+                                  "at once"));
+
+static llvm::cl::opt<bool>
+        Tiered("tiered",
+               llvm::cl::desc("With -jit, compile definitions at -O1 (or the "
+                              "given -O level) first and re-optimize hot "
+                              "ones at -O3 in the background"));
+
+static llvm::cl::opt<unsigned>
+        TierThreshold("tier-threshold",
+                      llvm::cl::desc("Calls before a function is re-optimized "
+                                     "under -tiered"),
+                      llvm::cl::init(1000));
+
+static llvm::cl::opt<bool>
+        TierStats("tier-stats",
+                  llvm::cl::desc("Print each function's tier and call count "
+                                 "on exit"));
+
+static llvm::cl::opt<std::string>
+        ObjectCacheDir("object-cache",
+                       llvm::cl::desc("With -jit, reuse object code from "
+                                      "earlier runs cached in this directory"),
+                       llvm::cl::value_desc("dir"));
+
+static llvm::cl::opt<unsigned>
+        ObjectCacheSize("object-cache-size",
+                        llvm::cl::desc("Object cache size limit in megabytes"),
+                        llvm::cl::init(256));
+
+static llvm::cl::opt<bool>
+        ObjectCacheStats("object-cache-stats",
+                         llvm::cl::desc("Print object cache hits and misses "
+                                        "on exit"));
+
+static llvm::cl::opt<bool>
+        SimplifyAST("ast-simplify",
+                    llvm::cl::desc("Fold constants and trivial identities in "
+                                   "the AST before generating code "
+                                   "(default on)"),
+                    llvm::cl::init(true));
+
+static llvm::cl::opt<unsigned>
+        EvalBudget("eval-budget",
+                   llvm::cl::desc("Steps -ast-simplify may spend evaluating "
+                                  "calls of pure functions with constant "
+                                  "arguments in one top-level item (0 = "
+                                  "don't evaluate calls)"),
+                   llvm::cl::init(100000));
+
+static llvm::cl::opt<bool>
+        Memoize("memoize",
+                llvm::cl::desc("Cache the results of pure recursive "
+                               "functions in a table per function"));
+
+static llvm::cl::opt<unsigned>
+        MemoEntries("memo-entries",
+                    llvm::cl::desc("Slots in each -memoize table, rounded "
+                                   "up to a power of two"),
+                    llvm::cl::init(4096));
+
+static llvm::cl::opt<bool>
+        MemoStats("memo-stats",
+                  llvm::cl::desc("Print each memoized function's hits and "
+                                 "misses on exit under -jit"));
+
+static llvm::cl::opt<bool>
+        LexOnly("lex-only",
+                llvm::cl::desc("Only tokenize the input and report lexer throughput"));
+
+static llvm::cl::opt<bool>
+        ParseOnly("parse-only",
+                  llvm::cl::desc("Only parse the input and report parse time and AST memory"));
+
+static llvm::cl::opt<bool>
+        Pretokenize("pretokenize",
+                    llvm::cl::desc("Tokenize the whole input before parsing"));
+
+static llvm::cl::opt<unsigned>
+        LexThreads("lex-threads",
+                   llvm::cl::desc("Threads used by -pretokenize (0 = one per core)"),
+                   llvm::cl::init(0));
+
+static llvm::cl::opt<unsigned>
+        CodegenThreads("codegen-threads",
+                       llvm::cl::desc("Split output.o into this many "
+                                      "partitions and generate code for them "
+                                      "in parallel"),
+                       llvm::cl::init(1));
+
+static llvm::cl::opt<unsigned>
+        StreamEvery("stream-every",
+                    llvm::cl::desc("Write output.o in fragments of this many "
+                                   "definitions, freeing the IR of each "
+                                   "fragment once it is written"),
+                    llvm::cl::value_desc("N"), llvm::cl::init(0));
+
+static llvm::cl::opt<std::string>
+        BatchList("batch",
+                  llvm::cl::desc("Compile every \"input [output]\" pair "
+                                 "listed in this file, skipping inputs that "
+                                 "haven't changed since they were last "
+                                 "compiled"),
+                  llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<unsigned>
+        BatchJobs("j",
+                  llvm::cl::desc("Inputs compiled at once by -batch "
+                                 "(0 = one per core)"),
+                  llvm::cl::init(0));
+
+static llvm::cl::opt<unsigned>
+        BenchInstances("bench-instances",
+                       llvm::cl::desc("Compile the input to object code in 1, "
+                                      "2, 4, ... up to N compiler instances "
+                                      "at once, one thread each, and report "
+                                      "throughput"),
+                       llvm::cl::value_desc("N"), llvm::cl::init(0));
+
+static llvm::cl::opt<std::string>
+        MCPU("mcpu",
+             llvm::cl::desc("CPU to generate code for, or \"native\" for the "
+                            "host's (default = generic, or native with -jit)"),
+             llvm::cl::value_desc("cpu-name"));
+
+static llvm::cl::list<std::string>
+        MAttrs("mattr", llvm::cl::CommaSeparated,
+               llvm::cl::desc("Target features to enable (+feature) or "
+                              "disable (-feature)"),
+               llvm::cl::value_desc("a1,+a2,-a3,..."));
+
+static llvm::cl::opt<llvm::Reloc::Model> RelocModel(
+        "relocation-model", llvm::cl::desc("Relocation model of emitted code"),
+        llvm::cl::values(
+                clEnumValN(llvm::Reloc::Static, "static",
+                           "Non-relocatable code"),
+                clEnumValN(llvm::Reloc::PIC_, "pic",
+                           "Position-independent code"),
+                clEnumValN(llvm::Reloc::DynamicNoPIC, "dynamic-no-pic",
+                           "Relocatable external references, "
+                           "non-relocatable code")));
+
+static llvm::cl::opt<llvm::CodeModel::Model> CMModel(
+        "code-model", llvm::cl::desc("Code model of emitted code"),
+        llvm::cl::init(llvm::CodeModel::Default),
+        llvm::cl::values(
+                clEnumValN(llvm::CodeModel::Small, "small", "Small code model"),
+                clEnumValN(llvm::CodeModel::Kernel, "kernel",
+                           "Kernel code model"),
+                clEnumValN(llvm::CodeModel::Medium, "medium",
+                           "Medium code model"),
+                clEnumValN(llvm::CodeModel::Large, "large",
+                           "Large code model")));
+
+static llvm::cl::opt<FPModel> FloatModel(
+        "fp-model",
+        llvm::cl::desc("Floating-point model; the -enable-*-fp-math and "
+                       "-fp-contract options override parts of it"),
+        llvm::cl::init(FPModel::Strict),
+        llvm::cl::values(
+                clEnumValN(FPModel::Strict, "strict",
+                           "Evaluate exactly as written (default)"),
+                clEnumValN(FPModel::Contract, "contract",
+                           "Fuse multiplies and adds"),
+                clEnumValN(FPModel::Fast, "fast",
+                           "Reassociate, fuse and assume finite values, as "
+                           "-ffast-math does")));
+
+static llvm::cl::opt<bool>
+        UnsafeFPMath("enable-unsafe-fp-math",
+                     llvm::cl::desc("Let code generation reassociate and "
+                                    "approximate floating-point math"));
+
+static llvm::cl::opt<bool>
+        NoInfsFPMath("enable-no-infs-fp-math",
+                     llvm::cl::desc("Let code generation assume no "
+                                    "floating-point value is infinite"));
+
+static llvm::cl::opt<bool>
+        NoNaNsFPMath("enable-no-nans-fp-math",
+                     llvm::cl::desc("Let code generation assume no "
+                                    "floating-point value is NaN"));
+
+static llvm::cl::opt<llvm::FPOpFusion::FPOpFusionMode> FuseFPOps(
+        "fp-contract",
+        llvm::cl::desc("Fusion of floating-point multiplies and adds during "
+                       "code generation"),
+        llvm::cl::init(llvm::FPOpFusion::Standard),
+        llvm::cl::values(
+                clEnumValN(llvm::FPOpFusion::Fast, "fast",
+                           "Fuse wherever profitable"),
+                clEnumValN(llvm::FPOpFusion::Standard, "on",
+                           "Only fuse 'fmuladd' intrinsics"),
+                clEnumValN(llvm::FPOpFusion::Strict, "off",
+                           "Never fuse")));
+
+// The table size for CompilerInstance::MemoEntries, or 0 without -memoize.
+static unsigned GetMemoEntries() {
+    if (!Memoize)
+        return 0;
+    return llvm::PowerOf2Ceil(std::max(MemoEntries.getValue(), 1u));
+}
+
+// Collects the target options on the command line for Triple. Host code
+// defaults to the host CPU and, under the JIT, the JIT's code model.
+static TargetSettings GetTargetSettings(const std::string &Triple, bool Host) {
+    TargetSettings TS;
+    TS.Triple = Triple;
+    if (!MCPU.empty())
+        TS.CPU = MCPU;
+    else if (Host)
+        TS.CPU = "native";
+    TS.Features = llvm::join(MAttrs.begin(), MAttrs.end(), ",");
+
+    ApplyFPModel(TS, FloatModel);
+    if (UnsafeFPMath.getNumOccurrences())
+        TS.Options.UnsafeFPMath = UnsafeFPMath;
+    if (NoInfsFPMath.getNumOccurrences())
+        TS.Options.NoInfsFPMath = NoInfsFPMath;
+    if (NoNaNsFPMath.getNumOccurrences())
+        TS.Options.NoNaNsFPMath = NoNaNsFPMath;
+    if (FuseFPOps.getNumOccurrences())
+        TS.Options.AllowFPOpFusion = FuseFPOps;
+
+    if (RelocModel.getNumOccurrences())
+        TS.RM = RelocModel;
+    if (CMModel.getNumOccurrences())
+        TS.CM = CMModel;
+    else if (Host)
+        TS.CM = llvm::CodeModel::JITDefault;
+
+    ResolveHostCPU(TS);
+    return TS;
+}
+
+// Optimizes the current module and writes it out as the next fragment, then
+// starts an empty one. Later fragments declare its functions again from their
+// prototypes when they call them, and no longer evaluate or expand them.
+static void FlushFragment(FragmentEmitter &Fragments) {
+    OptimizeModule(*TheCompiler->Module);
+    Fragments.emit(*TheCompiler->Module);
+    InitializeModuleAndPassManager();
+    ForgetKeptDefinitions();
+}
+
+// Compiles the input item by item. With Fragments, the module is flushed to a
+// new fragment every StreamEvery definitions.
+static void MainLoop(FragmentEmitter *Fragments = nullptr) {
+    CompilerInstance &CI = *TheCompiler;
+    unsigned Pending = 0;
     while (true) {
-        switch (CurTok) {
+        switch (CI.Parse.CurTok) {
         case tok_eof:
             return;
         case ';':
-            getNextToken();
+            CI.Parse.getNextToken();
             break;
         case tok_def:
             HandleDefinition();
+            if (Fragments && ++Pending == StreamEvery) {
+                FlushFragment(*Fragments);
+                Pending = 0;
+            }
             break;
         case tok_extern:
             HandleExtern();
@@ -36,8 +337,301 @@ static void MainLoop() {
             HandleTopLevelExpression();
             break;
         }
-        std::cerr << "ready> " << std::flush;
+        if (CI.Interactive)
+            std::cerr << "ready> " << std::flush;
+    }
+}
+
+static void ReportLexThroughput(uint64_t NumTokens, uint64_t Bytes,
+                                std::chrono::duration<double> Elapsed) {
+    double MB = Bytes / (1024.0 * 1024.0);
+    llvm::errs() << "Lexed " << NumTokens << " tokens from " << Bytes
+                 << " bytes in " << Elapsed.count() << "s ("
+                 << MB / Elapsed.count() << " MB/s)\n";
+}
+
+static int LexOnlyLoop(std::unique_ptr<InputSource> Source) {
+    Lexer L(std::move(Source), TheCompiler->Names);
+    uint64_t NumTokens = 0;
+
+    auto Start = std::chrono::steady_clock::now();
+    while (L.lex() != tok_eof)
+        NumTokens += 1;
+    ReportLexThroughput(NumTokens, L.getBytesRead(),
+                        std::chrono::steady_clock::now() - Start);
+    return 0;
+}
+
+static int LexOnlyBuffer(const llvm::MemoryBuffer &Buffer) {
+    TokenBuffer Tokens;
+
+    auto Start = std::chrono::steady_clock::now();
+    if (!lexAll(Buffer.getBuffer(), Tokens, TheCompiler->Names, LexThreads)) {
+        llvm::errs() << "Input too large to pretokenize\n";
+        return 1;
+    }
+    // Don't count the trailing tok_eof.
+    ReportLexThroughput(Tokens.size() - 1, Buffer.getBufferSize(),
+                        std::chrono::steady_clock::now() - Start);
+    return 0;
+}
+
+static int ParseOnlyLoop() {
+    CompilerInstance &CI = *TheCompiler;
+    Parser &P = CI.Parse;
+    uint64_t NumItems = 0;
+    size_t PeakArena = 0;
+
+    auto Start = std::chrono::steady_clock::now();
+    P.getNextToken();
+    while (P.CurTok != tok_eof) {
+        bool Parsed;
+        switch (P.CurTok) {
+        case ';':
+            P.getNextToken();
+            continue;
+        case tok_def:
+            Parsed = P.ParseDefinition() != nullptr;
+            break;
+        case tok_extern:
+            Parsed = P.ParseExtern() != nullptr;
+            break;
+        default:
+            Parsed = P.ParseTopLevelExpr() != nullptr;
+            break;
+        }
+        if (!Parsed)
+            P.getNextToken();
+
+        NumItems += 1;
+        PeakArena = std::max(PeakArena, CI.AST.getTotalMemory());
+        CI.AST.reset();
+    }
+    std::chrono::duration<double> Elapsed =
+            std::chrono::steady_clock::now() - Start;
+
+    llvm::errs() << "Parsed " << NumItems << " top-level items in "
+                 << Elapsed.count() << "s, peak AST arena " << PeakArena
+                 << " bytes\n";
+    return 0;
+}
+
+// Compiles Text to an object file in memory the way output.o is compiled,
+// in an instance and with a TargetMachine of its own. Returns false if the
+// source has errors.
+static bool CompileToObject(const TargetSettings &TS, llvm::StringRef Text,
+                            unsigned Level, ObjectBuffer &Obj) {
+    CompilerInstance CI;
+    CompilerScope Scope(CI);
+    CI.Interactive = false;
+    CI.SimplifyAST = SimplifyAST;
+    CI.EvalBudget = EvalBudget;
+    CI.MemoEntries = GetMemoEntries();
+    InitializeBinopPrecedence(CI.Parse);
+    CI.Parse.InitializeLexer(createMemorySource(Text));
+
+    auto TM = CreateTargetMachine(TS, Level);
+    if (!TM)
+        return false;
+    InitializeCodeGen(*TM, Level);
+    InitializeModuleAndPassManager();
+
+    CI.Parse.getNextToken();
+    MainLoop();
+    if (CI.NumErrors)
+        return false;
+    OptimizeModule(*CI.Module);
+
+    llvm::raw_svector_ostream OS(Obj);
+    return EmitObject(*TM, *CI.Module, OS);
+}
+
+static void CompileInstance(const TargetSettings &TS, llvm::StringRef Text,
+                            unsigned Level) {
+    ObjectBuffer Obj;
+    CompileToObject(TS, Text, Level, Obj);
+}
+
+// Compiles the input in 1, 2, 4, ... BenchInstances instances at once and
+// reports how throughput scales with the number of threads.
+static int BenchInstancesLoop(const TargetSettings &TS, unsigned Level) {
+    auto BufOrErr = llvm::MemoryBuffer::getFileOrSTDIN(InputFilename);
+    if (!BufOrErr) {
+        llvm::errs() << "Could not open " << InputFilename << ": "
+                     << BufOrErr.getError().message() << "\n";
+        return 1;
     }
+    llvm::StringRef Text = (*BufOrErr)->getBuffer();
+
+    llvm::errs() << "instances  seconds  compiles/s  speedup ("
+                 << std::thread::hardware_concurrency()
+                 << " hardware threads)\n";
+
+    double BaseRate = 0;
+    for (unsigned N = 1;; N = std::min<unsigned>(N * 2, BenchInstances)) {
+        auto Start = std::chrono::steady_clock::now();
+        std::vector<std::thread> Threads;
+        for (unsigned I = 0; I != N; ++I)
+            Threads.emplace_back(CompileInstance, std::cref(TS), Text, Level);
+        for (auto &Th : Threads)
+            Th.join();
+        std::chrono::duration<double> Elapsed =
+                std::chrono::steady_clock::now() - Start;
+
+        double Rate = N / Elapsed.count();
+        if (N == 1)
+            BaseRate = Rate;
+        llvm::errs() << llvm::format("%9u %8.3f %11.2f %7.2fx\n", N,
+                                     Elapsed.count(), Rate, Rate / BaseRate);
+        if (N == BenchInstances)
+            break;
+    }
+    return 0;
+}
+
+namespace {
+struct BatchJob {
+    std::string Input;
+    std::string Output;
+};
+
+enum JobResult { JobCompiled, JobUnchanged, JobFailed };
+} // end anonymous namespace
+
+// Reads "input [output]" lines; the output defaults to the input with a .o
+// extension. Blank lines and lines starting with '#' are skipped.
+static bool ReadBatchList(llvm::StringRef Path, std::vector<BatchJob> &Jobs) {
+    auto BufOrErr = llvm::MemoryBuffer::getFileOrSTDIN(Path);
+    if (!BufOrErr) {
+        llvm::errs() << "Could not open " << Path << ": "
+                     << BufOrErr.getError().message() << "\n";
+        return false;
+    }
+
+    llvm::SmallVector<llvm::StringRef, 0> Lines;
+    (*BufOrErr)->getBuffer().split(Lines, '\n', -1, false);
+    for (llvm::StringRef Line : Lines) {
+        Line = Line.trim();
+        if (Line.empty() || Line[0] == '#')
+            continue;
+
+        llvm::SmallVector<llvm::StringRef, 2> Fields;
+        Line.split(Fields, ' ', -1, false);
+        BatchJob J;
+        J.Input = Fields[0].str();
+        if (Fields.size() > 1) {
+            J.Output = Fields[1].str();
+        } else {
+            llvm::SmallString<128> Out(J.Input);
+            llvm::sys::path::replace_extension(Out, "o");
+            J.Output = Out.str().str();
+        }
+        Jobs.push_back(std::move(J));
+    }
+    return true;
+}
+
+// Everything but the source that a job's output depends on: the target and
+// its options, the optimization level, and the options that change the code
+// generated for the same source.
+static std::string GetBatchSalt(const llvm::TargetMachine &TM) {
+    std::string Salt = getTargetKey(TM);
+    llvm::raw_string_ostream OS(Salt);
+    OS << '\0' << SimplifyAST << '\0' << EvalBudget << '\0'
+       << GetMemoEntries();
+    return OS.str();
+}
+
+// The hash of what a job's output is built from, Salt from GetBatchSalt().
+static std::string HashJob(llvm::StringRef Salt, llvm::StringRef Text) {
+    llvm::MD5 Hash;
+    Hash.update(Salt);
+    Hash.update(Text);
+    llvm::MD5::MD5Result Result;
+    Hash.final(Result);
+    llvm::SmallString<32> Hex;
+    llvm::MD5::stringifyResult(Result, Hex);
+    return Hex.str().str();
+}
+
+// Compiles J unless its output is up to date. The hash of what the output was
+// built from is kept beside it in <output>.md5.
+static JobResult RunJob(const BatchJob &J, const TargetSettings &TS,
+                        unsigned Level, llvm::StringRef Salt) {
+    auto BufOrErr = llvm::MemoryBuffer::getFile(J.Input, -1, false);
+    if (!BufOrErr) {
+        llvm::errs() << "Could not open " << J.Input << ": "
+                     << BufOrErr.getError().message() << "\n";
+        return JobFailed;
+    }
+    llvm::StringRef Text = (*BufOrErr)->getBuffer();
+
+    std::string Hash = HashJob(Salt, Text);
+    std::string StampPath = J.Output + ".md5";
+    if (llvm::sys::fs::exists(J.Output)) {
+        auto Stamp = llvm::MemoryBuffer::getFile(StampPath);
+        if (Stamp && (*Stamp)->getBuffer() == Hash)
+            return JobUnchanged;
+    }
+
+    // No stamp may vouch for an output that is being replaced.
+    llvm::sys::fs::remove(StampPath);
+
+    ObjectBuffer Obj;
+    if (!CompileToObject(TS, Text, Level, Obj)) {
+        llvm::errs() << "Failed to compile " << J.Input << "\n";
+        return JobFailed;
+    }
+    if (!WriteObjects(Obj, J.Output))
+        return JobFailed;
+
+    std::error_code EC;
+    llvm::raw_fd_ostream Stamp(StampPath, EC, llvm::sys::fs::F_None);
+    if (!EC)
+        Stamp << Hash;
+    return JobCompiled;
+}
+
+// Compiles every input listed in BatchList on a pool of Jobs threads, each
+// input in a CompilerInstance of its own.
+static int BatchLoop(const TargetSettings &TS, unsigned Level) {
+    std::vector<BatchJob> Jobs;
+    if (!ReadBatchList(BatchList, Jobs))
+        return 1;
+
+    auto TM = CreateTargetMachine(TS, Level);
+    if (!TM)
+        return 1;
+    std::string Salt = GetBatchSalt(*TM);
+
+    std::atomic<size_t> NextJob(0);
+    std::atomic<unsigned> Counts[3];
+    for (auto &C : Counts)
+        C = 0;
+
+    auto Worker = [&] {
+        for (size_t I; (I = NextJob++) < Jobs.size();)
+            ++Counts[RunJob(Jobs[I], TS, Level, Salt)];
+    };
+
+    unsigned NumThreads = BatchJobs ? (unsigned)BatchJobs
+                                    : std::thread::hardware_concurrency();
+    NumThreads = std::max(1u, std::min<unsigned>(NumThreads, Jobs.size()));
+
+    auto Start = std::chrono::steady_clock::now();
+    std::vector<std::thread> Threads;
+    for (unsigned I = 0; I != NumThreads; ++I)
+        Threads.emplace_back(Worker);
+    for (auto &Th : Threads)
+        Th.join();
+    std::chrono::duration<double> Elapsed =
+            std::chrono::steady_clock::now() - Start;
+
+    llvm::outs() << "Compiled " << Counts[JobCompiled] << ", unchanged "
+                 << Counts[JobUnchanged] << ", failed " << Counts[JobFailed]
+                 << " of " << Jobs.size() << " inputs in " << Elapsed.count()
+                 << "s on " << NumThreads << " threads\n";
+    return Counts[JobFailed] ? 1 : 0;
 }
 
 #ifdef LLVM_ON_WIN32
@@ -58,21 +652,102 @@ extern "C" DLLEXPORT double printd(double X) {
     return 0;
 }
 
-int main() {
-    BinopPrecedence['='] = 2;
-    BinopPrecedence['<'] = 10;
-    BinopPrecedence['+'] = 20;
-    BinopPrecedence['-'] = 20;
-    BinopPrecedence['*'] = 40;
+int main(int argc, char **argv) {
+    // Prints the -time-passes report on the way out.
+    llvm::llvm_shutdown_obj Shutdown;
+    llvm::cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope compiler\n");
 
-    std::cerr << "ready> " << std::flush;
-    getNextToken();
+    if (OptLevel < '0' || OptLevel > '3') {
+        llvm::errs() << "Invalid optimization level -O" << OptLevel << "\n";
+        return 1;
+    }
+    unsigned Level = OptLevel - '0';
 
-    // TheJIT = llvm::make_unique<llvm::orc::KaleidoscopeJIT>();
+    // The main thread's instance, used by the REPL, the JIT and output.o.
+    CompilerInstance CI;
+    CompilerScope Scope(CI);
+    CI.SimplifyAST = SimplifyAST;
+    CI.EvalBudget = EvalBudget;
+    CI.MemoEntries = GetMemoEntries();
 
-    InitializeModuleAndPassManager();
+    if (Pretokenize) {
+        auto BufOrErr = llvm::MemoryBuffer::getFileOrSTDIN(InputFilename, -1, false);
+        if (!BufOrErr) {
+            llvm::errs() << "Could not open " << InputFilename << ": "
+                         << BufOrErr.getError().message() << "\n";
+            return 1;
+        }
 
-    MainLoop();
+        if (LexOnly)
+            return LexOnlyBuffer(**BufOrErr);
+
+        if (!CI.Parse.InitializeTokenBuffer(std::move(*BufOrErr), LexThreads)) {
+            llvm::errs() << "Input too large to pretokenize\n";
+            return 1;
+        }
+    } else {
+        auto Source = createFileSource(InputFilename);
+        if (!Source)
+            return 1;
+
+        if (LexOnly)
+            return LexOnlyLoop(std::move(Source));
+
+        CI.Parse.InitializeLexer(std::move(Source));
+    }
+
+    InitializeBinopPrecedence(CI.Parse);
+
+    if (ParseOnly)
+        return ParseOnlyLoop();
+
+    if (UseJIT) {
+        // Lazily compiled partitions would be compiled by the main thread
+        // without the JIT lock, racing the background compiler.
+        if (Tiered && Lazy) {
+            llvm::errs() << "-tiered can't be combined with -lazy\n";
+            return 1;
+        }
+
+        llvm::InitializeNativeTarget();
+        llvm::InitializeNativeTargetAsmPrinter();
+        llvm::InitializeNativeTargetAsmParser();
+
+        if (Tiered && !OptLevel.getNumOccurrences())
+            Level = 1;
+        TargetSettings TS =
+                GetTargetSettings(llvm::sys::getProcessTriple(), true);
+        auto TM = CreateTargetMachine(TS, Level);
+        if (!TM)
+            return 1;
+        InitializeJIT(std::move(TM), Lazy, PoolMemory, Level);
+        RegisterHostFunction("putchard", (void *)&putchard);
+        RegisterHostFunction("printd", (void *)&printd);
+        if (!ObjectCacheDir.empty())
+            EnableObjectCache(ObjectCacheDir,
+                              (uint64_t)ObjectCacheSize << 20);
+        if (Tiered)
+            InitializeTiering(TierThreshold, CreateTargetMachine(TS, 3));
+
+        std::cerr << "ready> " << std::flush;
+        CI.Parse.getNextToken();
+
+        InitializeModuleAndPassManager();
+
+        MainLoop();
+
+        ShutdownTiering();
+        if (TierStats)
+            PrintTierStats(llvm::errs());
+        if (ObjectCacheStats)
+            PrintObjectCacheStats(llvm::errs());
+        if (MemoStats)
+            PrintMemoStats(llvm::errs());
+
+        // The JIT may still hold modules in CI's context.
+        TheJIT.reset();
+        return 0;
+    }
 
     llvm::InitializeAllTargetInfos();
     llvm::InitializeAllTargets();
@@ -80,47 +755,81 @@ int main() {
     llvm::InitializeAllAsmParsers();
     llvm::InitializeAllAsmPrinters();
 
-    auto TargetTriple = llvm::sys::getDefaultTargetTriple();
-    TheModule->setTargetTriple(TargetTriple);
+    TargetSettings TS =
+            GetTargetSettings(llvm::sys::getDefaultTargetTriple(), false);
 
-    std::string Error;
-    auto Target = llvm::TargetRegistry::lookupTarget(TargetTriple, Error);
+    if (BenchInstances)
+        return BenchInstancesLoop(TS, Level);
+    if (!BatchList.empty())
+        return BatchLoop(TS, Level);
 
-    if (!Target) {
-        llvm::errs() << Error;
+    unsigned Threads = std::max(1u, (unsigned)CodegenThreads);
+    if (StreamEvery && Threads > 1) {
+        llvm::errs()
+                << "-stream-every can't be combined with -codegen-threads\n";
         return 1;
     }
 
-    auto CPU = "generic";
-    auto Features = "";
-
-    llvm::TargetOptions opt;
-    auto RM = llvm::Optional<llvm::Reloc::Model>();
-    auto TargetMachine = Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
+    auto TargetMachine = CreateTargetMachine(TS, Level);
+    if (!TargetMachine)
+        return 1;
 
-    TheModule->setDataLayout(TargetMachine->createDataLayout());
+    InitializeCodeGen(*TargetMachine, Level);
 
     auto Filename = "output.o";
-    std::error_code EC;
-    llvm::raw_fd_ostream dest(Filename, EC, llvm::sys::fs::F_None);
+    std::unique_ptr<FragmentEmitter> Fragments;
+    if (StreamEvery)
+        Fragments =
+                llvm::make_unique<FragmentEmitter>(*TargetMachine, Filename);
 
-    if (EC) {
-        llvm::errs() << "Could not open file: " << EC.message();
-        return 1;
-    }
+    std::cerr << "ready> " << std::flush;
+    CI.Parse.getNextToken();
 
-    llvm::legacy::PassManager pass;
-    auto FileType = llvm::TargetMachine::CGFT_ObjectFile;
+    InitializeModuleAndPassManager();
 
-    if (TargetMachine->addPassesToEmitFile(pass, dest, FileType)) {
-        llvm::errs() << "TargetMachine can't emit a file of this type";
-        return 1;
+    MainLoop(Fragments.get());
+
+    if (Fragments) {
+        FlushFragment(*Fragments);
+        size_t NumFragments = Fragments->size();
+        if (!Fragments->link())
+            return 1;
+        llvm::outs() << "Wrote " << Filename << " from " << NumFragments
+                     << " fragments\n";
+        return 0;
     }
 
-    pass.run(*TheModule);
-    dest.flush();
+    auto OptStart = std::chrono::steady_clock::now();
+    OptimizeModule(*CI.Module);
+    auto CodegenStart = std::chrono::steady_clock::now();
+
+    if (Threads > 1) {
+        std::vector<ObjectBuffer> Objects;
+        auto CreateTM = [&] { return CreateTargetMachine(TS, Level); };
+        EmitObjectsParallel(std::move(CI.Module), Threads, CreateTM, Objects);
+        if (!WriteObjects(Objects, Filename))
+            return 1;
+    } else {
+        std::error_code EC;
+        llvm::raw_fd_ostream dest(Filename, EC, llvm::sys::fs::F_None);
+
+        if (EC) {
+            llvm::errs() << "Could not open file: " << EC.message();
+            return 1;
+        }
+
+        if (!EmitObject(*TargetMachine, *CI.Module, dest))
+            return 1;
+        dest.flush();
+    }
 
-    llvm::outs() << "Wrote " << Filename << "\n";
+    auto End = std::chrono::steady_clock::now();
+    std::chrono::duration<double> OptTime = CodegenStart - OptStart;
+    std::chrono::duration<double> CodegenTime = End - CodegenStart;
+    llvm::outs() << "Wrote " << Filename << " (optimized in "
+                 << OptTime.count() << "s, generated code in "
+                 << CodegenTime.count() << "s on " << Threads
+                 << (Threads == 1 ? " thread)\n" : " threads)\n");
 
     return 0;
 }
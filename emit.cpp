@@ -0,0 +1,152 @@
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/CodeGen/ParallelCG.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Program.h"
+
+#include "emit.h"
+
+// ========================================================================
+// Object emission
+// ========================================================================
+
+bool EmitObject(llvm::TargetMachine &TM, llvm::Module &M,
+                llvm::raw_pwrite_stream &OS) {
+  llvm::legacy::PassManager pass;
+  auto FileType = llvm::TargetMachine::CGFT_ObjectFile;
+
+  if (TM.addPassesToEmitFile(pass, OS, FileType)) {
+    llvm::errs() << "TargetMachine can't emit a file of this type";
+    return false;
+  }
+
+  pass.run(M);
+  return true;
+}
+
+void EmitObjectsParallel(
+    std::unique_ptr<llvm::Module> M, unsigned NumParts,
+    const std::function<std::unique_ptr<llvm::TargetMachine>()> &CreateTM,
+    std::vector<ObjectBuffer> &Objects) {
+  Objects.clear();
+  Objects.resize(NumParts);
+
+  std::vector<std::unique_ptr<llvm::raw_svector_ostream>> Streams;
+  std::vector<llvm::raw_pwrite_stream *> OSs;
+  for (auto &Obj : Objects) {
+    Streams.push_back(llvm::make_unique<llvm::raw_svector_ostream>(Obj));
+    OSs.push_back(Streams.back().get());
+  }
+
+  // Each partition goes through bitcode into a context of its own, so the
+  // threads share nothing but the target registry.
+  llvm::splitCodeGen(std::move(M), OSs, {}, CreateTM);
+}
+
+bool LinkObjects(llvm::ArrayRef<std::string> Inputs, llvm::StringRef Output) {
+  auto LD = llvm::sys::findProgramByName("ld");
+  if (!LD) {
+    llvm::errs() << "Could not find ld to combine object files\n";
+    return false;
+  }
+
+  std::string OutputStr = Output.str();
+  std::vector<const char *> Args = {LD->c_str(), "-r", "-o",
+                                    OutputStr.c_str()};
+  for (auto &In : Inputs)
+    Args.push_back(In.c_str());
+  Args.push_back(nullptr);
+
+  std::string ErrMsg;
+  if (llvm::sys::ExecuteAndWait(*LD, Args.data(), nullptr, nullptr, 0, 0,
+                                &ErrMsg)) {
+    llvm::errs() << "ld -r failed";
+    if (!ErrMsg.empty())
+      llvm::errs() << ": " << ErrMsg;
+    llvm::errs() << "\n";
+    return false;
+  }
+  return true;
+}
+
+static bool WriteFile(llvm::StringRef Path, llvm::ArrayRef<char> Data) {
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::F_None);
+  if (EC) {
+    llvm::errs() << "Could not open file: " << EC.message();
+    return false;
+  }
+  OS.write(Data.data(), Data.size());
+  return true;
+}
+
+bool WriteObjects(llvm::ArrayRef<ObjectBuffer> Objects, llvm::StringRef Path) {
+  if (Objects.size() == 1)
+    return WriteFile(Path, Objects[0]);
+
+  std::vector<std::string> Parts;
+  bool OK = true;
+  for (auto &Obj : Objects) {
+    llvm::SmallString<128> PartPath;
+    if (std::error_code EC = llvm::sys::fs::createTemporaryFile(
+            "kaleidoscope-part", "o", PartPath)) {
+      llvm::errs() << "Could not create temporary file: " << EC.message()
+                   << "\n";
+      OK = false;
+      break;
+    }
+    Parts.push_back(PartPath.str().str());
+    if (!WriteFile(PartPath, Obj)) {
+      OK = false;
+      break;
+    }
+  }
+
+  if (OK)
+    OK = LinkObjects(Parts, Path);
+  for (auto &P : Parts)
+    llvm::sys::fs::remove(P);
+  return OK;
+}
+
+FragmentEmitter::~FragmentEmitter() {
+  for (auto &F : Fragments)
+    llvm::sys::fs::remove(F);
+}
+
+bool FragmentEmitter::emit(llvm::Module &M) {
+  int FD;
+  llvm::SmallString<128> Path;
+  if (std::error_code EC =
+          llvm::sys::fs::createUniqueFile(Output + "-%%%%%%%%.o", FD, Path)) {
+    llvm::errs() << "Could not create object fragment: " << EC.message()
+                 << "\n";
+    Failed = true;
+    return false;
+  }
+  Fragments.push_back(Path.str().str());
+
+  llvm::raw_fd_ostream OS(FD, true);
+  if (!EmitObject(TM, M, OS))
+    Failed = true;
+  return !Failed;
+}
+
+bool FragmentEmitter::link() {
+  if (Failed)
+    return false;
+  if (Fragments.size() == 1) {
+    if (std::error_code EC = llvm::sys::fs::rename(Fragments[0], Output)) {
+      llvm::errs() << "Could not write " << Output << ": " << EC.message()
+                   << "\n";
+      return false;
+    }
+    Fragments.clear();
+    return true;
+  }
+  return LinkObjects(Fragments, Output);
+}
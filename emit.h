@@ -0,0 +1,68 @@
+#ifndef KALEIDOSCOPE_EMIT_H
+#define KALEIDOSCOPE_EMIT_H
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+// ========================================================================
+// Object emission
+// ========================================================================
+
+typedef llvm::SmallVector<char, 0> ObjectBuffer;
+
+// Generates object code for M into OS. Prints a diagnostic and returns false
+// if TM can't emit object files.
+bool EmitObject(llvm::TargetMachine &TM, llvm::Module &M,
+                llvm::raw_pwrite_stream &OS);
+
+// Splits M into NumParts partitions of whole functions and generates object
+// code for them on as many threads, each partition in an LLVMContext of its
+// own and with a TargetMachine from CreateTM. M should already be optimized:
+// functions in different partitions can't be inlined into each other.
+void EmitObjectsParallel(
+    std::unique_ptr<llvm::Module> M, unsigned NumParts,
+    const std::function<std::unique_ptr<llvm::TargetMachine>()> &CreateTM,
+    std::vector<ObjectBuffer> &Objects);
+
+// Combines the relocatable objects Inputs into the single relocatable object
+// Output with the system linker (ld -r).
+bool LinkObjects(llvm::ArrayRef<std::string> Inputs, llvm::StringRef Output);
+
+// Writes Objects to Path as one relocatable object, linking them together
+// first if there is more than one.
+bool WriteObjects(llvm::ArrayRef<ObjectBuffer> Objects, llvm::StringRef Path);
+
+// Writes a program's object code out a module at a time as it is generated,
+// so only the IR of the module being filled needs to be in memory. The
+// fragments are temporary files beside the output, linked into it at the end.
+class FragmentEmitter {
+  llvm::TargetMachine &TM;
+  std::string Output;
+  std::vector<std::string> Fragments;
+  bool Failed = false;
+
+public:
+  FragmentEmitter(llvm::TargetMachine &TM, llvm::StringRef Output)
+      : TM(TM), Output(Output) {}
+  // Removes any fragments left behind.
+  ~FragmentEmitter();
+
+  // Generates code for M into a new fragment.
+  bool emit(llvm::Module &M);
+  // Combines the fragments into the output file. Fails if any fragment
+  // failed.
+  bool link();
+
+  size_t size() const { return Fragments.size(); }
+};
+
+#endif // KALEIDOSCOPE_EMIT_H
@@ -0,0 +1,315 @@
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include "ast.h"
+#include "compiler.h"
+#include "eval.h"
+
+// ========================================================================
+// Compile-time evaluation
+// ========================================================================
+
+static bool isPureFunction(SymbolID Name) {
+    SymbolTables &S = TheCompiler->Symbols;
+    return Name < S.FunctionDefs.size() && S.FunctionDefs[Name].Pure;
+}
+
+bool isPureDefinition(const FunctionAST &F, bool *Recursive) {
+    SymbolID Self = F.getProto()->getName();
+    if (Recursive)
+        *Recursive = false;
+    auto IsPureCallee = [&](SymbolID Callee) {
+        if (Callee != Self)
+            return isPureFunction(Callee);
+        if (Recursive)
+            *Recursive = true;
+        return true;
+    };
+
+    llvm::SmallVector<ExprAST *, 16> Worklist;
+    Worklist.push_back(F.getBody());
+    while (!Worklist.empty()) {
+        ExprAST *E = Worklist.pop_back_val();
+        switch (E->getKind()) {
+        case ExprAST::EK_Number:
+        case ExprAST::EK_Variable:
+            break;
+        case ExprAST::EK_Binary: {
+            auto *B = llvm::cast<BinaryExprAST>(E);
+            if (!isBuiltinBinaryOp(B->getOp()) &&
+                !IsPureCallee(getBinaryOpSymbol(B->getOp())))
+                return false;
+            Worklist.push_back(B->getLHS());
+            Worklist.push_back(B->getRHS());
+            break;
+        }
+        case ExprAST::EK_Unary: {
+            auto *U = llvm::cast<UnaryExprAST>(E);
+            if (!IsPureCallee(getUnaryOpSymbol(U->getOpcode())))
+                return false;
+            Worklist.push_back(U->getOperand());
+            break;
+        }
+        case ExprAST::EK_Call: {
+            auto *C = llvm::cast<CallExprAST>(E);
+            if (!IsPureCallee(C->getCallee()))
+                return false;
+            for (ExprAST *Arg : C->getArgs())
+                Worklist.push_back(Arg);
+            break;
+        }
+        case ExprAST::EK_Var: {
+            auto *V = llvm::cast<VarExprAST>(E);
+            for (auto &Var : V->getVarNames())
+                if (Var.second)
+                    Worklist.push_back(Var.second);
+            Worklist.push_back(V->getBody());
+            break;
+        }
+        case ExprAST::EK_If: {
+            auto *I = llvm::cast<IfExprAST>(E);
+            Worklist.push_back(I->getCond());
+            Worklist.push_back(I->getThen());
+            Worklist.push_back(I->getElse());
+            break;
+        }
+        case ExprAST::EK_For: {
+            auto *Loop = llvm::cast<ForExprAST>(E);
+            Worklist.push_back(Loop->getStart());
+            Worklist.push_back(Loop->getEnd());
+            if (Loop->getStep())
+                Worklist.push_back(Loop->getStep());
+            Worklist.push_back(Loop->getBody());
+            break;
+        }
+        }
+    }
+    return true;
+}
+
+bool evaluateBuiltinBinary(int Op, double L, double R, double &Result) {
+    switch (Op) {
+    case '+': Result = L + R; return true;
+    case '-': Result = L - R; return true;
+    case '*': Result = L * R; return true;
+    // The orderings are unordered, so true if either side is NaN.
+    case '<': Result = !(L >= R); return true;
+    case '>': Result = !(L <= R); return true;
+    case tok_le: Result = !(L > R); return true;
+    case tok_ge: Result = !(L < R); return true;
+    case tok_eq: Result = L == R; return true;
+    case tok_ne: Result = L != R; return true;
+    case '&': Result = isTrue(L) && isTrue(R); return true;
+    case '|': Result = isTrue(L) || isTrue(R); return true;
+    }
+    return false;
+}
+
+namespace {
+// Walks the AST of pure functions with variables held as doubles. Every
+// failure abandons the whole evaluation, so scopes needn't be unwound then.
+class Evaluator {
+    SymbolTables &S;
+    SymbolID Excluded;
+    uint64_t &Budget;
+    unsigned Depth = 0;
+
+    // Variable values indexed by SymbolID, with the values that inner
+    // bindings shadow, as in ScopedBindings.
+    std::vector<double> Values;
+    std::vector<std::pair<SymbolID, double>> Shadowed;
+
+    // Deep enough for real recursion, shallow enough for the native stack.
+    static const unsigned MaxDepth = 1000;
+
+    void bind(SymbolID Name, double V) {
+        if (Name >= Values.size())
+            Values.resize(Name + 1);
+        Shadowed.push_back(std::make_pair(Name, Values[Name]));
+        Values[Name] = V;
+    }
+
+    void popTo(size_t Mark) {
+        while (Shadowed.size() > Mark) {
+            Values[Shadowed.back().first] = Shadowed.back().second;
+            Shadowed.pop_back();
+        }
+    }
+
+    bool evalNode(ExprAST *E, double &V);
+    bool evalFor(ForExprAST *F, double &V);
+
+public:
+    Evaluator(SymbolTables &S, SymbolID Excluded, uint64_t &Budget)
+            : S(S), Excluded(Excluded), Budget(Budget) {}
+
+    bool eval(ExprAST *E, double &V) {
+        if (!Budget || Depth == MaxDepth)
+            return false;
+        --Budget;
+        ++Depth;
+        bool OK = evalNode(E, V);
+        --Depth;
+        return OK;
+    }
+
+    bool call(SymbolID Callee, llvm::ArrayRef<double> Args, double &V);
+};
+} // end anonymous namespace
+
+bool Evaluator::call(SymbolID Callee, llvm::ArrayRef<double> Args,
+                     double &V) {
+    if (Callee == Excluded || !isPureFunction(Callee))
+        return false;
+
+    FunctionAST *F = S.FunctionDefs[Callee].AST;
+    if (!F)
+        return false;
+    llvm::ArrayRef<SymbolID> Params = F->getProto()->getArgs();
+    if (Params.size() != Args.size())
+        return false;
+
+    size_t Mark = Shadowed.size();
+    for (unsigned i = 0, e = Params.size(); i != e; ++i)
+        bind(Params[i], Args[i]);
+    if (!eval(F->getBody(), V))
+        return false;
+    popTo(Mark);
+    return true;
+}
+
+// Mirrors ForExprAST::codegen(): the body runs before the end condition is
+// first tested, and the step is added after the condition is evaluated.
+bool Evaluator::evalFor(ForExprAST *F, double &V) {
+    double Start;
+    if (!eval(F->getStart(), Start))
+        return false;
+
+    size_t Mark = Shadowed.size();
+    SymbolID Var = F->getVarName();
+    bind(Var, Start);
+
+    while (true) {
+        double Ignored, Step = 1.0, End;
+        if (!eval(F->getBody(), Ignored))
+            return false;
+        if (F->getStep() && !eval(F->getStep(), Step))
+            return false;
+        if (!eval(F->getEnd(), End))
+            return false;
+        Values[Var] += Step;
+        if (!isTrue(End))
+            break;
+    }
+
+    popTo(Mark);
+    V = 0.0;
+    return true;
+}
+
+bool Evaluator::evalNode(ExprAST *E, double &V) {
+    switch (E->getKind()) {
+    case ExprAST::EK_Number:
+        V = llvm::cast<NumberExprAST>(E)->getVal();
+        return true;
+
+    case ExprAST::EK_Variable: {
+        SymbolID Name = llvm::cast<VariableExprAST>(E)->getName();
+        if (Name >= Values.size())
+            return false;
+        V = Values[Name];
+        return true;
+    }
+
+    case ExprAST::EK_Binary: {
+        auto *B = llvm::cast<BinaryExprAST>(E);
+        int Op = B->getOp();
+        double L, R;
+
+        if (Op == '=') {
+            auto *Dest = llvm::dyn_cast<VariableExprAST>(B->getLHS());
+            if (!Dest || Dest->getName() >= Values.size() ||
+                !eval(B->getRHS(), V))
+                return false;
+            Values[Dest->getName()] = V;
+            return true;
+        }
+
+        if (!eval(B->getLHS(), L))
+            return false;
+        if (Op == '&' || Op == '|') {
+            // The right side is only evaluated if the left doesn't decide.
+            if (isTrue(L) == (Op == '|')) {
+                V = isTrue(L);
+                return true;
+            }
+            if (!eval(B->getRHS(), R))
+                return false;
+            V = isTrue(R);
+            return true;
+        }
+
+        if (!eval(B->getRHS(), R))
+            return false;
+        if (evaluateBuiltinBinary(Op, L, R, V))
+            return true;
+        double Args[2] = {L, R};
+        return call(getBinaryOpSymbol(Op), Args, V);
+    }
+
+    case ExprAST::EK_Unary: {
+        auto *U = llvm::cast<UnaryExprAST>(E);
+        double Operand;
+        if (!eval(U->getOperand(), Operand))
+            return false;
+        return call(getUnaryOpSymbol(U->getOpcode()), Operand, V);
+    }
+
+    case ExprAST::EK_Call: {
+        auto *C = llvm::cast<CallExprAST>(E);
+        llvm::SmallVector<double, 8> Args;
+        for (ExprAST *Arg : C->getArgs()) {
+            Args.push_back(0.0);
+            if (!eval(Arg, Args.back()))
+                return false;
+        }
+        return call(C->getCallee(), Args, V);
+    }
+
+    case ExprAST::EK_Var: {
+        auto *Var = llvm::cast<VarExprAST>(E);
+        size_t Mark = Shadowed.size();
+        for (auto &Binding : Var->getVarNames()) {
+            double Init = 0.0;
+            if (Binding.second && !eval(Binding.second, Init))
+                return false;
+            bind(Binding.first, Init);
+        }
+        if (!eval(Var->getBody(), V))
+            return false;
+        popTo(Mark);
+        return true;
+    }
+
+    case ExprAST::EK_If: {
+        auto *I = llvm::cast<IfExprAST>(E);
+        double Cond;
+        if (!eval(I->getCond(), Cond))
+            return false;
+        return eval(isTrue(Cond) ? I->getThen() : I->getElse(), V);
+    }
+
+    case ExprAST::EK_For:
+        return evalFor(llvm::cast<ForExprAST>(E), V);
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+bool evaluateCall(SymbolID Callee, llvm::ArrayRef<double> Args,
+                  SymbolID Excluded, uint64_t &Budget, double &Result) {
+    Evaluator E(TheCompiler->Symbols, Excluded, Budget);
+    return E.call(Callee, Args, Result);
+}
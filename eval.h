@@ -0,0 +1,37 @@
+#ifndef KALEIDOSCOPE_EVAL_H
+#define KALEIDOSCOPE_EVAL_H
+
+#include <cstdint>
+
+#include "llvm/ADT/ArrayRef.h"
+
+#include "lexer.h"
+
+// Forward declarations
+class FunctionAST;
+
+// ========================================================================
+// Compile-time evaluation
+// ========================================================================
+
+// Truth as conditions test it: nonzero and not NaN.
+inline bool isTrue(double V) { return V < 0 || V > 0; }
+
+// Whether F only calls itself and functions already known to be pure, so
+// that it neither reads input nor has effects through externs such as
+// putchard and printd. Sets *Recursive if F calls itself directly.
+bool isPureDefinition(const FunctionAST &F, bool *Recursive = nullptr);
+
+// Evaluates the builtin binary operator Op on constants the way the
+// generated code does. Returns false for user-defined operators.
+bool evaluateBuiltinBinary(int Op, double L, double R, double &Result);
+
+// Interprets a call to Callee with Args in the current instance, giving up
+// if it reaches a function that isn't pure or whose body isn't kept, calls
+// Excluded, or runs out of Budget. Every step, including those of a failed
+// evaluation, is taken from Budget. Definitions are the ones current when it
+// is called.
+bool evaluateCall(SymbolID Callee, llvm::ArrayRef<double> Args,
+                  SymbolID Excluded, uint64_t &Budget, double &Result);
+
+#endif // KALEIDOSCOPE_EVAL_H
@@ -1,92 +1,257 @@
+#include <cassert>
+#include <cstdint>
 #include <iostream>
 
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Value.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
 
 #include "ast.h"
+#include "compiler.h"
 #include "jit.h"
+#include "objcache.h"
 #include "parser.h"
+#include "simplify.h"
+#include "target.h"
+#include "tier.h"
 
 // ========================================================================
 // Top-level parsing and JIT generator
 // ========================================================================
 
-std::unique_ptr<llvm::Module> TheModule;
-// std::unique_ptr<llvm::legacy::FunctionPassManager> TheFPM;
-// std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
+std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
+std::mutex TheJITMutex;
+
+static std::unique_ptr<DiskObjectCache> TheObjectCache;
+// The instance whose target and pipelines TheJIT compiles with.
+static CompilerInstance *JITCompiler;
+
+// Modules that OptimizeModuleAt() has already run the full pipeline on.
+static const char *const PreOptimizedFlag = "kaleidoscope.optimized";
+// Generates machine code for those modules, if set.
+static llvm::TargetMachine *PreOptimizedTM;
+
+// Sets up PMB the way clang does for the same level: the full inliner from
+// -O2, only always_inline at -O1, and the loop and SLP vectorizers at -O3.
+static void ConfigurePassManagerBuilder(llvm::PassManagerBuilder &PMB,
+                                        llvm::TargetMachine &TM,
+                                        unsigned Level) {
+  PMB.OptLevel = Level;
+  PMB.SizeLevel = 0;
+  if (Level > 1)
+    PMB.Inliner = llvm::createFunctionInliningPass(Level, 0);
+  else if (Level == 1)
+    PMB.Inliner = llvm::createAlwaysInlinerLegacyPass();
+  PMB.LoopVectorize = Level > 2;
+  PMB.SLPVectorize = Level > 2;
+  PMB.LibraryInfo = new llvm::TargetLibraryInfoImpl(TM.getTargetTriple());
+}
+
+void InitializeCodeGen(llvm::TargetMachine &TM, unsigned Level) {
+  CompilerInstance &CI = *TheCompiler;
+  CI.TM = &TM;
+  CI.OptLevel = Level;
+  // Every floating-point operation the code generator emits carries these.
+  CI.Builder.setFastMathFlags(getFastMathFlags(TM.Options));
+
+  CI.MPM = llvm::make_unique<llvm::legacy::PassManager>();
+  CI.MPM->add(llvm::createTargetTransformInfoWrapperPass(
+      TM.getTargetIRAnalysis()));
+
+  llvm::PassManagerBuilder PMB;
+  ConfigurePassManagerBuilder(PMB, TM, Level);
+  PMB.populateModulePassManager(*CI.MPM);
+}
+
+void OptimizeModule(llvm::Module &M) { TheCompiler->MPM->run(M); }
+
+static void AddFunctionPasses(llvm::legacy::FunctionPassManager &FPM,
+                              llvm::TargetMachine &TM, unsigned Level) {
+  FPM.add(
+      llvm::createTargetTransformInfoWrapperPass(TM.getTargetIRAnalysis()));
+
+  llvm::PassManagerBuilder PMB;
+  ConfigurePassManagerBuilder(PMB, TM, Level);
+  PMB.populateFunctionPassManager(FPM);
+}
+
+static void RunFunctionPasses(llvm::Module &M, llvm::TargetMachine &TM,
+                              unsigned Level) {
+  llvm::legacy::FunctionPassManager FPM(&M);
+  AddFunctionPasses(FPM, TM, Level);
+  FPM.doInitialization();
+  for (auto &F : M)
+    FPM.run(F);
+  FPM.doFinalization();
+}
+
+void OptimizeModuleAt(llvm::Module &M, llvm::TargetMachine &TM,
+                      unsigned Level) {
+  RunFunctionPasses(M, TM, Level);
+
+  llvm::legacy::PassManager MPM;
+  MPM.add(
+      llvm::createTargetTransformInfoWrapperPass(TM.getTargetIRAnalysis()));
+  llvm::PassManagerBuilder PMB;
+  ConfigurePassManagerBuilder(PMB, TM, Level);
+  PMB.populateModulePassManager(MPM);
+  MPM.run(M);
+
+  M.addModuleFlag(llvm::Module::Warning, PreOptimizedFlag, 1);
+}
+
+// Called by the JIT on each module (or, when lazy, each single-function
+// partition) right before it is compiled, so functions that are never run
+// are never optimized either.
+static std::unique_ptr<llvm::Module>
+OptimizeForJIT(std::unique_ptr<llvm::Module> M) {
+  if (M->getModuleFlag(PreOptimizedFlag))
+    return M;
+
+  RunFunctionPasses(*M, *JITCompiler->TM, JITCompiler->OptLevel);
+  JITCompiler->MPM->run(*M);
+  return M;
+}
+
+static llvm::TargetMachine *SelectMachineForJIT(llvm::Module &M) {
+  return M.getModuleFlag(PreOptimizedFlag) ? PreOptimizedTM : nullptr;
+}
+
+void InitializeJIT(std::unique_ptr<llvm::TargetMachine> TM, bool Lazy,
+                   bool PoolMemory, unsigned Level) {
+  JITCompiler = TheCompiler;
+  TheJIT = llvm::make_unique<llvm::orc::KaleidoscopeJIT>(
+      std::move(TM), Lazy, PoolMemory, OptimizeForJIT, SelectMachineForJIT);
+  InitializeCodeGen(TheJIT->getTargetMachine(), Level);
+}
+
+void SetPreOptimizedMachine(llvm::TargetMachine &TM) { PreOptimizedTM = &TM; }
+
+void RegisterHostFunction(const std::string &Name, void *Addr) {
+  TheJIT->addHostSymbol(Name, Addr);
+}
+
+void EnableObjectCache(llvm::StringRef Dir, uint64_t MaxBytes) {
+  TheObjectCache = llvm::make_unique<DiskObjectCache>(
+      Dir, MaxBytes, *JITCompiler->TM, JITCompiler->OptLevel);
+  TheJIT->setObjectCache(TheObjectCache.get());
+}
+
+void PrintObjectCacheStats(llvm::raw_ostream &OS) {
+  if (TheObjectCache)
+    TheObjectCache->printStats(OS);
+}
 
 void HandleDefinition() {
-  if (auto FnAST = ParseDefinition()) {
+  CompilerInstance &CI = *TheCompiler;
+  if (auto FnAST = CI.Parse.ParseDefinition()) {
+    if (CI.SimplifyAST)
+      simplifyFunction(CI.AST, *FnAST);
     if (auto *FnIR = FnAST->codegen()) {
-      std::cerr << "Read function definition: ";
-      FnIR->print(llvm::errs());
-      std::cerr << "\n";
-      // TheJIT->addModule(std::move(TheModule));
-      // InitializeModuleAndPassManager();
+      if (CI.Interactive) {
+        std::cerr << "Read function definition: ";
+        FnIR->print(llvm::errs());
+        std::cerr << "\n";
+      }
+      if (TheJIT) {
+        std::lock_guard<std::mutex> Lock(TheJITMutex);
+        TheJIT->freeRetiredDefinitions();
+        if (isTieringEnabled())
+          InstrumentForTiering(*CI.Module);
+        TheJIT->addDefinitions(std::move(CI.Module));
+        InitializeModuleAndPassManager();
+      }
     }
   } else {
-    getNextToken();
+    CI.Parse.getNextToken();
   }
+  CI.AST.reset();
 }
 
 void HandleExtern() {
-  if (auto ProtoAST = ParseExtern()) {
+  CompilerInstance &CI = *TheCompiler;
+  if (auto ProtoAST = CI.Parse.ParseExtern()) {
     if (auto *FnIR = ProtoAST->codegen()) {
-      std::cerr << "Read extern: ";
-      FnIR->print(llvm::errs());
-      std::cerr << "\n";
-      FunctionProtos[ProtoAST->getName()] = std::move(ProtoAST);
+      if (CI.Interactive) {
+        std::cerr << "Read extern: ";
+        FnIR->print(llvm::errs());
+        std::cerr << "\n";
+      }
+      addPrototype(*ProtoAST);
     }
   } else {
-    getNextToken();
+    CI.Parse.getNextToken();
   }
+  CI.AST.reset();
 }
 
 void HandleTopLevelExpression() {
-  if (auto FnAST = ParseTopLevelExpr()) {
+  CompilerInstance &CI = *TheCompiler;
+  if (auto FnAST = CI.Parse.ParseTopLevelExpr()) {
+    if (CI.SimplifyAST)
+      simplifyFunction(CI.AST, *FnAST);
     if (auto *FnIR = FnAST->codegen()) {
-      std::cerr << "Read top-level expression: ";
-      FnIR->print(llvm::errs());
-      std::cerr << "\n";
+      if (CI.Interactive) {
+        std::cerr << "Read top-level expression: ";
+        FnIR->print(llvm::errs());
+        std::cerr << "\n";
+      }
 
-      // auto H = TheJIT->addModule(std::move(TheModule));
-      // InitializeModuleAndPassManager();
+      if (TheJIT) {
+        // The expression gets a module of its own, which is thrown away as
+        // soon as it has run; definitions stay live in the JIT.
+        std::unique_lock<std::mutex> Lock(TheJITMutex);
+        TheJIT->freeRetiredDefinitions();
+        auto H = TheJIT->addModule(std::move(CI.Module));
+        InitializeModuleAndPassManager();
 
-      // auto ExprSymbol = TheJIT->findSymbol("__anon_expr");
-      // assert(ExprSymbol && "Function not found");
+        auto ExprSymbol = TheJIT->findSymbol("__anon_expr");
+        if (!ExprSymbol) {
+          fprintf(stderr, "Error: could not find compiled expression\n");
+          TheJIT->removeModule(H);
+          CI.AST.reset();
+          return;
+        }
 
-      // double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
-      // double output = FP();
-      // std::cerr << "Evaluated to " << output << std::endl;
+        double (*FP)() = (double (*)())(intptr_t)ExprSymbol.getAddress();
+        // A background tier-up may swap stubs while this runs.
+        Lock.unlock();
+        double output = FP();
+        std::cerr << "Evaluated to " << output << std::endl;
 
-      // TheJIT->removeModule(H);
+        Lock.lock();
+        TheJIT->removeModule(H);
+      }
     } else {
       fprintf(stderr, "Error generating code for top level expr");
     }
   } else {
-    getNextToken();
+    CI.Parse.getNextToken();
   }
+  CI.AST.reset();
 }
 
 void InitializeModuleAndPassManager() {
-  TheModule = llvm::make_unique<llvm::Module>("my cool jit", TheContext);
-  // TheModule->setDataLayout(TheJIT->getTargetMachine().createDataLayout());
-
-  // TheFPM =
-  //     llvm::make_unique<llvm::legacy::FunctionPassManager>(TheModule.get());
-
-  // TheFPM->add(llvm::createPromoteMemoryToRegisterPass());
-  // TheFPM->add(llvm::createInstructionCombiningPass());
-  // TheFPM->add(llvm::createReassociatePass());
-  // TheFPM->add(llvm::createInstructionCombiningPass());
-  // TheFPM->add(llvm::createReassociatePass());
-  // TheFPM->add(llvm::createGVNPass());
-  // TheFPM->add(llvm::createCFGSimplificationPass());
-  // TheFPM->doInitialization();
+  CompilerInstance &CI = *TheCompiler;
+  CI.Module = llvm::make_unique<llvm::Module>("my cool jit", CI.Context);
+  CI.Module->setDataLayout(CI.TM->createDataLayout());
+  CI.Module->setTargetTriple(CI.TM->getTargetTriple().str());
+  ClearFunctionCache();
+
+  // The JIT optimizes each module as it compiles it.
+  if (TheJIT)
+    return;
+
+  CI.FPM =
+      llvm::make_unique<llvm::legacy::FunctionPassManager>(CI.Module.get());
+  AddFunctionPasses(*CI.FPM, *CI.TM, CI.OptLevel);
+  CI.FPM->doInitialization();
 }
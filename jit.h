@@ -3,23 +3,60 @@
 
 #include <map>
 #include <memory>
+#include <mutex>
 
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Value.h"
+#include "llvm/Target/TargetMachine.h"
 
 #include "KaleidoscopeJIT.h"
 
 // Forward declarations
 class PrototypeAST;
 
-extern std::unique_ptr<llvm::Module> TheModule;
-// extern std::unique_ptr<llvm::legacy::FunctionPassManager> TheFPM;
-// extern std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
+// Null unless running with -jit. When set, each top-level item is compiled in
+// a module of its own and handed to the JIT; otherwise everything accumulates
+// in the current CompilerInstance's module for object file output.
+extern std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
+// Held for every use of TheJIT, which background tier-ups also modify. It is
+// released while JIT'd code runs.
+extern std::mutex TheJITMutex;
 
 void HandleDefinition();
 void HandleExtern();
 void HandleTopLevelExpression();
+
+// Selects the target and optimization level (0-3) for every module the
+// current instance creates in InitializeModuleAndPassManager(), and builds
+// its module pipeline. Arithmetic is generated with the fast-math flags TM's
+// floating-point options allow.
+void InitializeCodeGen(llvm::TargetMachine &TM, unsigned OptLevel);
+// Creates TheJIT generating code with TM, optionally compiling functions
+// lazily on first call and packing modules into shared slabs of memory, and
+// sets up code generation for the current instance as InitializeCodeGen()
+// does. The JIT optimizes with that instance's pipelines from then on, so it
+// must outlive TheJIT.
+void InitializeJIT(std::unique_ptr<llvm::TargetMachine> TM, bool Lazy,
+                   bool PoolMemory, unsigned OptLevel);
+// Binds Name in JIT'd code directly to a function of the compiler's own.
+void RegisterHostFunction(const std::string &Name, void *Addr);
+// Makes TheJIT reuse object code compiled by earlier runs from Dir, keeping
+// the directory under MaxBytes.
+void EnableObjectCache(llvm::StringRef Dir, uint64_t MaxBytes);
+void PrintObjectCacheStats(llvm::raw_ostream &OS);
 void InitializeModuleAndPassManager();
+// Runs the module-level pipeline (inliner, IPO, loop passes) on M.
+void OptimizeModule(llvm::Module &M);
+// Runs the function and module pipelines for Level on M with pass managers of
+// its own, so it can be used from another thread on a module in another
+// LLVMContext. Marks M so the JIT doesn't optimize it again.
+void OptimizeModuleAt(llvm::Module &M, llvm::TargetMachine &TM,
+                      unsigned Level);
+// Makes TheJIT generate machine code for modules marked by
+// OptimizeModuleAt() with TM instead of its own TargetMachine, so their
+// code generation runs at TM's level too. TM must target the host, and is
+// used by whichever thread adds those modules.
+void SetPreOptimizedMachine(llvm::TargetMachine &TM);
 
 #endif // KALEIDOSCOPE_JIT_H
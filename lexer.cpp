@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <thread>
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "lexer.h"
+
+// ========================================================================
+// Identifier interning
+// ========================================================================
+
+static const struct {
+    const char *Spelling;
+    int Tok;
+} Keywords[] = {
+    {"def", tok_def},       {"extern", tok_extern}, {"if", tok_if},
+    {"then", tok_then},     {"else", tok_else},     {"for", tok_for},
+    {"in", tok_in},         {"binary", tok_binary}, {"unary", tok_unary},
+    {"var", tok_var},
+};
+
+static const SymbolID NumKeywords = llvm::array_lengthof(Keywords);
+
+Interner::Interner() {
+    for (auto &K : Keywords)
+        intern(K.Spelling);
+}
+
+SymbolID Interner::intern(llvm::StringRef Name) {
+    auto Result = IDs.insert(std::make_pair(Name, (SymbolID)Names.size()));
+    if (Result.second)
+        Names.push_back(Result.first->getKey());
+    return Result.first->second;
+}
+
+// ========================================================================
+// Input sources
+// ========================================================================
+
+bool BufferSource::fill(const char *&Begin, const char *&End) {
+    if (Filled)
+        return false;
+
+    Filled = true;
+    Begin = Buffer->getBufferStart();
+    End = Buffer->getBufferEnd();
+    return true;
+}
+
+bool StdinSource::fill(const char *&Begin, const char *&End) {
+    char Chunk[4096];
+
+    Line.clear();
+    while (std::fgets(Chunk, sizeof(Chunk), stdin)) {
+        Line += Chunk;
+        if (Line.back() == '\n')
+            break;
+    }
+
+    if (Line.empty())
+        return false;
+
+    Begin = Line.data();
+    End = Line.data() + Line.size();
+    return true;
+}
+
+std::unique_ptr<InputSource> createFileSource(llvm::StringRef Path) {
+    if (Path == "-")
+        return llvm::make_unique<StdinSource>();
+
+    // Without a null terminator requirement, MemoryBuffer maps any file
+    // bigger than a few pages instead of copying it.
+    auto BufOrErr = llvm::MemoryBuffer::getFile(Path, -1, false);
+    if (!BufOrErr) {
+        llvm::errs() << "Could not open " << Path << ": "
+                     << BufOrErr.getError().message() << "\n";
+        return nullptr;
+    }
+
+    return llvm::make_unique<BufferSource>(std::move(*BufOrErr));
+}
+
+std::unique_ptr<InputSource> createMemorySource(llvm::StringRef Text) {
+    return llvm::make_unique<BufferSource>(
+            llvm::MemoryBuffer::getMemBufferCopy(Text));
+}
+
+// ========================================================================
+// Lexer (token generation)
+// ========================================================================
+
+// ASCII-only classification; the <cctype> versions go through the locale on
+// every character.
+static inline bool isSpace(char C) {
+    return C == ' ' || (C >= '\t' && C <= '\r');
+}
+
+static inline bool isDigit(char C) { return C >= '0' && C <= '9'; }
+
+static inline bool isAlpha(char C) {
+    return (C >= 'a' && C <= 'z') || (C >= 'A' && C <= 'Z');
+}
+
+static inline bool isAlnum(char C) { return isAlpha(C) || isDigit(C); }
+
+bool Lexer::refill() {
+    if (!Source || !Source->fill(Cur, End)) {
+        Cur = End = nullptr;
+        return false;
+    }
+
+    BytesRead += End - Cur;
+    return true;
+}
+
+int Lexer::lex() {
+    while (true) {
+        while (Cur != End && isSpace(*Cur))
+            ++Cur;
+
+        if (Cur == End) {
+            if (!refill()) {
+                TokText = llvm::StringRef();
+                return tok_eof;
+            }
+            continue;
+        }
+
+        if (*Cur != '#')
+            break;
+
+        while (Cur != End && *Cur != '\n' && *Cur != '\r')
+            ++Cur;
+    }
+
+    const char *Start = Cur;
+
+    if (isAlpha(*Cur)) {
+        do
+            ++Cur;
+        while (Cur != End && isAlnum(*Cur));
+
+        TokText = llvm::StringRef(Start, Cur - Start);
+        Identifier = Names.intern(TokText);
+        if (Identifier < NumKeywords)
+            return Keywords[Identifier].Tok;
+        return tok_identifier;
+    }
+
+    if (isDigit(*Cur) || *Cur == '.') {
+        do
+            ++Cur;
+        while (Cur != End && (isDigit(*Cur) || *Cur == '.'));
+
+        TokText = llvm::StringRef(Start, Cur - Start);
+
+        // strtod needs a terminator, which a mapped buffer doesn't have.
+        llvm::SmallString<32> NumStr(TokText);
+        NumVal = std::strtod(NumStr.c_str(), nullptr);
+        return tok_number;
+    }
+
+    if (Cur + 1 != End && Cur[1] == '=') {
+        int Tok = 0;
+        switch (*Cur) {
+        case '=': Tok = tok_eq; break;
+        case '!': Tok = tok_ne; break;
+        case '<': Tok = tok_le; break;
+        case '>': Tok = tok_ge; break;
+        }
+        if (Tok) {
+            Cur += 2;
+            TokText = llvm::StringRef(Start, 2);
+            return Tok;
+        }
+    }
+
+    TokText = llvm::StringRef(Start, 1);
+    return (unsigned char)*Cur++;
+}
+
+// ========================================================================
+// Token buffer
+// ========================================================================
+
+void TokenBuffer::clear() {
+    Kinds.clear();
+    Offsets.clear();
+    Lengths.clear();
+    Payloads.clear();
+    Numbers.clear();
+}
+
+// Below this many bytes per thread, spawning threads costs more than it
+// saves.
+static const size_t MinBytesPerThread = 1 << 20;
+
+static void lexRange(const char *Base, const char *Begin, const char *End,
+                     TokenBuffer &Tokens, Interner &Names) {
+    Lexer L(Begin, End, Names);
+
+    // Roughly one token per five bytes of typical source.
+    size_t Estimate = (End - Begin) / 5;
+    Tokens.Kinds.reserve(Estimate);
+    Tokens.Offsets.reserve(Estimate);
+    Tokens.Lengths.reserve(Estimate);
+    Tokens.Payloads.reserve(Estimate);
+
+    int Tok;
+    while ((Tok = L.lex()) != tok_eof) {
+        llvm::StringRef Text = L.getTokText();
+        uint32_t Payload = 0;
+        if (Tok == tok_identifier) {
+            Payload = L.getIdentifier();
+        } else if (Tok == tok_number) {
+            Payload = Tokens.Numbers.size();
+            Tokens.Numbers.push_back(L.getNumVal());
+        }
+
+        Tokens.Kinds.push_back(Tok);
+        Tokens.Offsets.push_back(Text.data() - Base);
+        Tokens.Lengths.push_back(Text.size());
+        Tokens.Payloads.push_back(Payload);
+    }
+}
+
+bool lexAll(llvm::StringRef Text, TokenBuffer &Tokens, Interner &Names,
+            unsigned NumThreads) {
+    if (Text.size() >= std::numeric_limits<uint32_t>::max())
+        return false;
+
+    if (NumThreads == 0)
+        NumThreads = std::max(1u, std::thread::hardware_concurrency());
+    NumThreads = std::min<size_t>(NumThreads,
+                                  Text.size() / MinBytesPerThread + 1);
+
+    // Any point just after a newline is a safe place to split: no token
+    // spans lines, and a comment always ends at the newline.
+    std::vector<const char *> Splits;
+    Splits.push_back(Text.begin());
+    for (unsigned i = 1; i < NumThreads; ++i) {
+        size_t Pos = Text.find('\n', Text.size() / NumThreads * i);
+        if (Pos == llvm::StringRef::npos)
+            break;
+        if (Text.begin() + Pos + 1 > Splits.back())
+            Splits.push_back(Text.begin() + Pos + 1);
+    }
+    Splits.push_back(Text.end());
+
+    Tokens.clear();
+    size_t NumChunks = Splits.size() - 1;
+    if (NumChunks == 1) {
+        lexRange(Text.begin(), Text.begin(), Text.end(), Tokens, Names);
+    } else {
+        // Each chunk interns into its own table; the IDs are mapped into
+        // Names once per distinct spelling while stitching.
+        std::vector<TokenBuffer> Chunks(NumChunks);
+        std::vector<Interner> ChunkNames(NumChunks);
+        std::vector<std::thread> Workers;
+        for (size_t i = 1; i < NumChunks; ++i)
+            Workers.emplace_back(lexRange, Text.begin(), Splits[i],
+                                 Splits[i + 1], std::ref(Chunks[i]),
+                                 std::ref(ChunkNames[i]));
+        lexRange(Text.begin(), Splits[0], Splits[1], Chunks[0], ChunkNames[0]);
+        for (auto &W : Workers)
+            W.join();
+
+        size_t Total = 0;
+        for (auto &C : Chunks)
+            Total += C.size();
+        Tokens.Kinds.reserve(Total + 1);
+        Tokens.Offsets.reserve(Total + 1);
+        Tokens.Lengths.reserve(Total + 1);
+        Tokens.Payloads.reserve(Total + 1);
+
+        std::vector<SymbolID> Remap;
+        for (size_t n = 0; n != NumChunks; ++n) {
+            TokenBuffer &C = Chunks[n];
+
+            Remap.resize(ChunkNames[n].size());
+            for (SymbolID ID = 0, e = Remap.size(); ID != e; ++ID)
+                Remap[ID] = Names.intern(ChunkNames[n].getName(ID));
+
+            uint32_t NumberBase = Tokens.Numbers.size();
+            for (size_t i = 0, e = C.size(); i != e; ++i) {
+                if (C.Kinds[i] == tok_identifier)
+                    C.Payloads[i] = Remap[C.Payloads[i]];
+                else if (C.Kinds[i] == tok_number)
+                    C.Payloads[i] += NumberBase;
+            }
+
+            Tokens.Kinds.insert(Tokens.Kinds.end(), C.Kinds.begin(),
+                                C.Kinds.end());
+            Tokens.Offsets.insert(Tokens.Offsets.end(), C.Offsets.begin(),
+                                  C.Offsets.end());
+            Tokens.Lengths.insert(Tokens.Lengths.end(), C.Lengths.begin(),
+                                  C.Lengths.end());
+            Tokens.Payloads.insert(Tokens.Payloads.end(), C.Payloads.begin(),
+                                   C.Payloads.end());
+            Tokens.Numbers.insert(Tokens.Numbers.end(), C.Numbers.begin(),
+                                  C.Numbers.end());
+        }
+    }
+
+    Tokens.Kinds.push_back(tok_eof);
+    Tokens.Offsets.push_back(Text.size());
+    Tokens.Lengths.push_back(0);
+    Tokens.Payloads.push_back(0);
+    return true;
+}
@@ -0,0 +1,172 @@
+#ifndef KALEIDOSCOPE_LEXER_H
+#define KALEIDOSCOPE_LEXER_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+enum Token {
+  tok_eof = -1,
+
+  tok_def = -2,
+  tok_extern = -3,
+
+  tok_identifier = -4,
+  tok_number = -5,
+
+  tok_if = -6,
+  tok_then = -7,
+  tok_else = -8,
+
+  tok_for = -9,
+  tok_in = -10,
+
+  tok_binary = -11,
+  tok_unary = -12,
+
+  tok_var = -13,
+
+  // comparisons spelled with two characters
+  tok_eq = -14,
+  tok_ne = -15,
+  tok_le = -16,
+  tok_ge = -17
+};
+
+// ========================================================================
+// Identifier interning
+// ========================================================================
+
+typedef unsigned SymbolID;
+
+// Maps every distinct identifier spelling to a dense integer ID, so later
+// stages can index tables by name instead of hashing strings. Keywords are
+// interned first, in a fixed order, and so have the same IDs in every
+// Interner.
+class Interner {
+    llvm::StringMap<SymbolID, llvm::BumpPtrAllocator> IDs;
+    std::vector<llvm::StringRef> Names;
+
+public:
+    Interner();
+
+    SymbolID intern(llvm::StringRef Name);
+    llvm::StringRef getName(SymbolID ID) const { return Names[ID]; }
+    size_t size() const { return Names.size(); }
+};
+
+// ========================================================================
+// Input sources
+// ========================================================================
+
+// An InputSource hands the lexer its input one contiguous chunk at a time.
+// No token may span two chunks, so every chunk except the last must end on a
+// line boundary.
+class InputSource {
+public:
+    virtual ~InputSource() = default;
+
+    // Makes the next chunk available in [Begin, End). Returns false once the
+    // input is exhausted. The previous chunk may be invalidated.
+    virtual bool fill(const char *&Begin, const char *&End) = 0;
+};
+
+// The whole input in a single buffer: either a memory-mapped file or an
+// in-memory string.
+class BufferSource : public InputSource {
+    std::unique_ptr<llvm::MemoryBuffer> Buffer;
+    bool Filled = false;
+
+public:
+    explicit BufferSource(std::unique_ptr<llvm::MemoryBuffer> Buffer)
+            : Buffer(std::move(Buffer)) {}
+
+    bool fill(const char *&Begin, const char *&End) override;
+    llvm::MemoryBuffer &getBuffer() { return *Buffer; }
+};
+
+// Reads stdin a line at a time so an interactive session sees each token as
+// soon as its line is complete.
+class StdinSource : public InputSource {
+    std::string Line;
+
+public:
+    bool fill(const char *&Begin, const char *&End) override;
+};
+
+// Opens Path as a memory-mapped BufferSource, or a StdinSource for "-".
+// Returns nullptr and prints a diagnostic if the file can't be read.
+std::unique_ptr<InputSource> createFileSource(llvm::StringRef Path);
+std::unique_ptr<InputSource> createMemorySource(llvm::StringRef Text);
+
+// ========================================================================
+// Lexer
+// ========================================================================
+
+class Lexer {
+    std::unique_ptr<InputSource> Source;
+    Interner &Names;
+    const char *Cur = nullptr;
+    const char *End = nullptr;
+    uint64_t BytesRead = 0;
+
+    llvm::StringRef TokText;
+    SymbolID Identifier = 0;
+    double NumVal = 0;
+
+    bool refill();
+
+public:
+    Lexer(std::unique_ptr<InputSource> Source, Interner &Names)
+            : Source(std::move(Source)), Names(Names) {}
+
+    // Lexes a fixed range of memory that the caller keeps alive.
+    Lexer(const char *Begin, const char *End, Interner &Names)
+            : Names(Names), Cur(Begin), End(End) {}
+
+    // Returns the next token: one of the Token enumerators or a raw ASCII
+    // character.
+    int lex();
+
+    // Spelling of the last token, viewed directly in the input. Valid until
+    // the next call to lex().
+    llvm::StringRef getTokText() const { return TokText; }
+    SymbolID getIdentifier() const { return Identifier; }
+    double getNumVal() const { return NumVal; }
+
+    uint64_t getBytesRead() const { return BytesRead; }
+};
+
+// ========================================================================
+// Token buffer
+// ========================================================================
+
+// A whole input tokenized up front, stored as parallel arrays. Offsets and
+// lengths locate each token's spelling in the source text. The payload of an
+// identifier is its SymbolID and that of a number is an index into Numbers.
+// The last token is always tok_eof.
+struct TokenBuffer {
+    std::vector<int16_t> Kinds;
+    std::vector<uint32_t> Offsets;
+    std::vector<uint32_t> Lengths;
+    std::vector<uint32_t> Payloads;
+    std::vector<double> Numbers;
+
+    size_t size() const { return Kinds.size(); }
+    void clear();
+};
+
+// Tokenizes Text into Tokens, interning identifiers into Names. Inputs large
+// enough to be worth it are split at line boundaries and lexed on up to
+// NumThreads threads (0 picks one per hardware thread). Returns false if Text
+// is too big to index with 32-bit offsets.
+bool lexAll(llvm::StringRef Text, TokenBuffer &Tokens, Interner &Names,
+            unsigned NumThreads);
+
+#endif // KALEIDOSCOPE_LEXER_H
@@ -1,17 +1,20 @@
 #include <memory>
 
 #include "ast.h"
+#include "compiler.h"
 
 // Forward declarations
 class ExprAST;
 class PrototypeAST;
 
-std::unique_ptr<ExprAST> LogError(const char *Str) {
+ExprAST *LogError(const char *Str) {
   fprintf(stderr, "Error: %s\n", Str);
+  if (TheCompiler)
+    ++TheCompiler->NumErrors;
   return nullptr;
 }
 
-std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
+PrototypeAST *LogErrorP(const char *Str) {
   LogError(Str);
   return nullptr;
 }
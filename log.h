@@ -9,8 +9,8 @@
 class ExprAST;
 class PrototypeAST;
 
-std::unique_ptr<ExprAST> LogError(const char *Str);
-std::unique_ptr<PrototypeAST> LogErrorP(const char *Str);
+ExprAST *LogError(const char *Str);
+PrototypeAST *LogErrorP(const char *Str);
 llvm::Value *LogErrorV(const char *Str);
 
 #endif // KALEIDOSCOPE_LOG_H
@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <iterator>
+
+#include "llvm/Support/MathExtras.h"
+
+#include "memmgr.h"
+
+// ========================================================================
+// Pooled JIT memory
+// ========================================================================
+
+// Every block is a multiple of this, so freed blocks merge cleanly.
+static const uintptr_t MinAlignment = 16;
+
+static uintptr_t getBlockSize(uintptr_t Size) {
+  return llvm::alignTo(std::max<uintptr_t>(Size, 1), MinAlignment);
+}
+
+SlabPool::~SlabPool() {
+  for (auto &A : Arenas)
+    for (auto &Slab : A.Slabs)
+      llvm::sys::Memory::releaseMappedMemory(Slab);
+}
+
+bool SlabPool::addSlab(Kind K, uintptr_t MinSize) {
+  unsigned Flags = llvm::sys::Memory::MF_READ | llvm::sys::Memory::MF_WRITE;
+  if (K == Code)
+    Flags |= llvm::sys::Memory::MF_EXEC;
+
+  // Code refers to its constant pools PC-relatively, so keep every slab near
+  // the others.
+  const llvm::sys::MemoryBlock *Near = nullptr;
+  for (auto &A : Arenas)
+    if (!A.Slabs.empty())
+      Near = &A.Slabs.back();
+
+  std::error_code EC;
+  llvm::sys::MemoryBlock Slab = llvm::sys::Memory::allocateMappedMemory(
+      std::max<uintptr_t>(SlabSize, MinSize), Near, Flags, EC);
+  if (EC)
+    return false;
+
+  Arena &A = Arenas[K];
+  A.Slabs.push_back(Slab);
+  release(K, (uint8_t *)Slab.base(), Slab.size());
+  return true;
+}
+
+uint8_t *SlabPool::allocateFrom(Arena &A, uintptr_t Size,
+                                uintptr_t Alignment) {
+  for (auto I = A.Free.begin(), E = A.Free.end(); I != E; ++I) {
+    uintptr_t Start = I->first;
+    uintptr_t End = Start + I->second;
+    uintptr_t Addr = llvm::alignTo(Start, Alignment);
+    if (Addr + Size > End)
+      continue;
+
+    A.Free.erase(I);
+    if (Addr > Start)
+      A.Free[Start] = Addr - Start;
+    if (Addr + Size < End)
+      A.Free[Addr + Size] = End - (Addr + Size);
+    return (uint8_t *)Addr;
+  }
+  return nullptr;
+}
+
+uint8_t *SlabPool::allocate(Kind K, uintptr_t Size, unsigned Alignment) {
+  uintptr_t Align = std::max<uintptr_t>(Alignment, MinAlignment);
+  Size = getBlockSize(Size);
+
+  if (uint8_t *Addr = allocateFrom(Arenas[K], Size, Align))
+    return Addr;
+  if (!addSlab(K, Size + Align))
+    return nullptr;
+  return allocateFrom(Arenas[K], Size, Align);
+}
+
+void SlabPool::release(Kind K, uint8_t *Addr, uintptr_t Size) {
+  auto &Free = Arenas[K].Free;
+  uintptr_t Start = (uintptr_t)Addr;
+  uintptr_t End = Start + Size;
+
+  // Merge with the free ranges on either side.
+  auto Next = Free.lower_bound(Start);
+  if (Next != Free.end() && Next->first == End) {
+    End += Next->second;
+    Next = Free.erase(Next);
+  }
+  if (Next != Free.begin()) {
+    auto Prev = std::prev(Next);
+    if (Prev->first + Prev->second == Start) {
+      Prev->second = End - Prev->first;
+      return;
+    }
+  }
+  Free[Start] = End - Start;
+}
+
+PooledMemoryManager::~PooledMemoryManager() {
+  for (auto &F : EHFrames)
+    deregisterEHFramesInProcess(F.first, F.second);
+  for (auto &B : Blocks)
+    Pool.release(B.Kind, B.Addr, B.Size);
+}
+
+uint8_t *PooledMemoryManager::allocateCodeSection(uintptr_t Size,
+                                                  unsigned Alignment,
+                                                  unsigned SectionID,
+                                                  llvm::StringRef SectionName) {
+  uint8_t *Addr = Pool.allocate(SlabPool::Code, Size, Alignment);
+  if (Addr) {
+    Blocks.push_back({SlabPool::Code, Addr, getBlockSize(Size)});
+    PendingCode.push_back(llvm::sys::MemoryBlock(Addr, Size));
+  }
+  return Addr;
+}
+
+uint8_t *PooledMemoryManager::allocateDataSection(uintptr_t Size,
+                                                  unsigned Alignment,
+                                                  unsigned SectionID,
+                                                  llvm::StringRef SectionName,
+                                                  bool IsReadOnly) {
+  // Read-only data shares the writable slabs; protecting it would need pages
+  // of its own.
+  uint8_t *Addr = Pool.allocate(SlabPool::Data, Size, Alignment);
+  if (Addr)
+    Blocks.push_back({SlabPool::Data, Addr, getBlockSize(Size)});
+  return Addr;
+}
+
+bool PooledMemoryManager::finalizeMemory(std::string *ErrMsg) {
+  // The slabs are already executable; only the instruction cache needs to see
+  // the new code.
+  for (auto &MB : PendingCode)
+    llvm::sys::Memory::InvalidateInstructionCache(MB.base(), MB.size());
+  PendingCode.clear();
+  return false;
+}
+
+void PooledMemoryManager::registerEHFrames(uint8_t *Addr, uint64_t LoadAddr,
+                                           size_t Size) {
+  registerEHFramesInProcess(Addr, Size);
+  EHFrames.push_back(std::make_pair(Addr, Size));
+}
+
+void PooledMemoryManager::deregisterEHFrames(uint8_t *Addr, uint64_t LoadAddr,
+                                             size_t Size) {
+  auto I = std::find(EHFrames.begin(), EHFrames.end(),
+                     std::make_pair(Addr, Size));
+  if (I == EHFrames.end())
+    return;
+  deregisterEHFramesInProcess(Addr, Size);
+  EHFrames.erase(I);
+}
@@ -0,0 +1,83 @@
+#ifndef KALEIDOSCOPE_MEMMGR_H
+#define KALEIDOSCOPE_MEMMGR_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
+#include "llvm/Support/Memory.h"
+
+// ========================================================================
+// Pooled JIT memory
+// ========================================================================
+
+// Large mappings carved up between the sections of many JIT'd modules, so a
+// small module costs a few bytes of a slab rather than a page per section and
+// the mmap/mprotect calls that go with it.
+//
+// Code slabs are mapped read/write/execute once. Sections of different
+// modules share pages, and a page can't be flipped between writable and
+// executable while another module's code on it may be running. That gives
+// up W^X for JIT'd code, so the pool is opt-in. Not thread-safe; the JIT
+// serializes all use.
+class SlabPool {
+public:
+  enum Kind { Code, Data, NumKinds };
+
+  explicit SlabPool(size_t SlabSize = 1 << 20) : SlabSize(SlabSize) {}
+  ~SlabPool();
+
+  uint8_t *allocate(Kind K, uintptr_t Size, unsigned Alignment);
+  void release(Kind K, uint8_t *Addr, uintptr_t Size);
+
+private:
+  struct Arena {
+    std::vector<llvm::sys::MemoryBlock> Slabs;
+    // Free ranges by start address, so neighbours can be merged on release.
+    std::map<uintptr_t, uintptr_t> Free;
+  };
+
+  size_t SlabSize;
+  Arena Arenas[NumKinds];
+
+  uint8_t *allocateFrom(Arena &A, uintptr_t Size, uintptr_t Alignment);
+  bool addSlab(Kind K, uintptr_t MinSize);
+};
+
+// The memory manager of a single module, allocating from a shared pool and
+// giving everything back when the module is removed.
+class PooledMemoryManager : public llvm::RTDyldMemoryManager {
+  struct Block {
+    SlabPool::Kind Kind;
+    uint8_t *Addr;
+    uintptr_t Size;
+  };
+
+  SlabPool &Pool;
+  std::vector<Block> Blocks;
+  // Code written since the last finalizeMemory().
+  std::vector<llvm::sys::MemoryBlock> PendingCode;
+  std::vector<std::pair<uint8_t *, size_t>> EHFrames;
+
+public:
+  explicit PooledMemoryManager(SlabPool &Pool) : Pool(Pool) {}
+  ~PooledMemoryManager() override;
+
+  uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID,
+                               llvm::StringRef SectionName) override;
+  uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                               unsigned SectionID, llvm::StringRef SectionName,
+                               bool IsReadOnly) override;
+  bool finalizeMemory(std::string *ErrMsg = nullptr) override;
+
+  void registerEHFrames(uint8_t *Addr, uint64_t LoadAddr,
+                        size_t Size) override;
+  void deregisterEHFrames(uint8_t *Addr, uint64_t LoadAddr,
+                          size_t Size) override;
+};
+
+#endif // KALEIDOSCOPE_MEMMGR_H
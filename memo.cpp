@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MathExtras.h"
+
+#include "jit.h"
+#include "memo.h"
+#include "objcache.h"
+
+// ========================================================================
+// Memoization
+// ========================================================================
+
+namespace {
+struct MemoInfo {
+    std::string Name;
+    // Slots whose valid word equals this hold current results. 0 turns the
+    // table off.
+    uint64_t Generation = 1;
+    uint64_t Hits = 0;
+    uint64_t Misses = 0;
+    // Entries slots of {valid, keys..., result}, all 8 bytes wide.
+    std::vector<uint64_t> Table;
+};
+} // end anonymous namespace
+
+// One entry per live definition memoized under the JIT. Only the main
+// thread generates and runs JIT code, so it needs no lock.
+static std::vector<std::unique_ptr<MemoInfo>> Memoized;
+
+static llvm::Constant *getHostAddress(void *Addr, llvm::Type *Ty) {
+    llvm::LLVMContext &Ctx = Ty->getContext();
+    return llvm::ConstantExpr::getIntToPtr(
+            llvm::ConstantInt::get(llvm::Type::getInt64Ty(Ctx),
+                                   (uintptr_t)Addr),
+            Ty->getPointerTo());
+}
+
+static void emitIncrement(llvm::IRBuilder<> &B, llvm::Value *Counter) {
+    B.CreateStore(B.CreateAdd(B.CreateLoad(Counter), B.getInt64(1)),
+                  Counter);
+}
+
+llvm::Function *MemoizeFunction(llvm::Function &F, unsigned Entries) {
+    llvm::Module &M = *F.getParent();
+    llvm::LLVMContext &Ctx = F.getContext();
+    std::string Name = F.getName().str();
+    unsigned NumArgs = F.arg_size();
+
+    // The original body becomes the implementation; F keeps its name and
+    // callers.
+    llvm::Function *Impl = llvm::Function::Create(
+            F.getFunctionType(), llvm::Function::InternalLinkage,
+            Name + ".memo.impl", &M);
+    Impl->getBasicBlockList().splice(Impl->end(), F.getBasicBlockList());
+    for (auto I = F.arg_begin(), J = Impl->arg_begin(), E = F.arg_end();
+         I != E; ++I, ++J) {
+        J->takeName(&*I);
+        I->replaceAllUsesWith(&*J);
+    }
+
+    llvm::IRBuilder<> B(llvm::BasicBlock::Create(Ctx, "entry", &F));
+    llvm::Type *Int64Ty = B.getInt64Ty();
+    llvm::StructType *EntryTy = llvm::StructType::get(
+            Ctx, {Int64Ty, llvm::ArrayType::get(Int64Ty, NumArgs),
+                  F.getReturnType()});
+    llvm::ArrayType *TableTy = llvm::ArrayType::get(EntryTy, Entries);
+
+    llvm::Constant *Table, *Hits, *Misses, *GenerationPtr = nullptr;
+    if (TheJIT) {
+        auto Info = llvm::make_unique<MemoInfo>();
+        Info->Name = Name;
+        Info->Table.assign((size_t)Entries * (NumArgs + 2), 0);
+        Table = getHostAddress(Info->Table.data(), TableTy);
+        Hits = getHostAddress(&Info->Hits, Int64Ty);
+        Misses = getHostAddress(&Info->Misses, Int64Ty);
+        GenerationPtr = getHostAddress(&Info->Generation, Int64Ty);
+        Memoized.push_back(std::move(Info));
+
+        // The table is a host address, which differs from run to run.
+        if (!M.getModuleFlag(DiskObjectCache::NoCacheFlag))
+            M.addModuleFlag(llvm::Module::Warning,
+                            DiskObjectCache::NoCacheFlag, 1);
+    } else {
+        Table = new llvm::GlobalVariable(
+                M, TableTy, false, llvm::GlobalValue::InternalLinkage,
+                llvm::ConstantAggregateZero::get(TableTy),
+                Name + ".memo.table");
+        Hits = new llvm::GlobalVariable(
+                M, Int64Ty, false, llvm::GlobalValue::ExternalLinkage,
+                B.getInt64(0), Name + ".memo.hits");
+        Misses = new llvm::GlobalVariable(
+                M, Int64Ty, false, llvm::GlobalValue::ExternalLinkage,
+                B.getInt64(0), Name + ".memo.misses");
+    }
+
+    // Hash the argument bits multiplicatively and take the top bits, so
+    // arguments differing only in low mantissa bits still spread out.
+    llvm::SmallVector<llvm::Value *, 8> Args, Keys;
+    llvm::Value *Hash = B.getInt64(0);
+    for (auto &Arg : F.args()) {
+        Args.push_back(&Arg);
+        Keys.push_back(B.CreateBitCast(&Arg, Int64Ty));
+        Hash = B.CreateMul(B.CreateXor(Hash, Keys.back()),
+                           B.getInt64(0x9E3779B97F4A7C15ULL));
+    }
+    unsigned Bits = llvm::Log2_32(Entries);
+    llvm::Value *Index =
+            Bits ? B.CreateLShr(Hash, 64 - Bits) : B.getInt64(0);
+    llvm::Value *Slot =
+            B.CreateInBoundsGEP(TableTy, Table, {B.getInt64(0), Index});
+
+    // Object files can't see redefinitions, so their tables never change
+    // generation.
+    llvm::Value *Generation =
+            GenerationPtr ? B.CreateLoad(GenerationPtr) : B.getInt64(1);
+
+    // Keys are compared as bits, so -0.0 and 0.0 are different arguments
+    // and a NaN matches itself.
+    llvm::Value *ValidPtr = B.CreateStructGEP(EntryTy, Slot, 0);
+    llvm::Value *Hit = B.CreateAnd(
+            B.CreateICmpEQ(B.CreateLoad(ValidPtr), Generation),
+            B.CreateICmpNE(Generation, B.getInt64(0)));
+    llvm::SmallVector<llvm::Value *, 8> KeyPtrs;
+    for (unsigned i = 0; i != NumArgs; ++i) {
+        KeyPtrs.push_back(B.CreateInBoundsGEP(
+                EntryTy, Slot,
+                {B.getInt32(0), B.getInt32(1), B.getInt32(i)}));
+        Hit = B.CreateAnd(Hit, B.CreateICmpEQ(B.CreateLoad(KeyPtrs.back()),
+                                              Keys[i]));
+    }
+    llvm::Value *ResultPtr = B.CreateStructGEP(EntryTy, Slot, 2);
+
+    llvm::BasicBlock *HitBB = llvm::BasicBlock::Create(Ctx, "hit", &F);
+    llvm::BasicBlock *MissBB = llvm::BasicBlock::Create(Ctx, "miss", &F);
+    B.CreateCondBr(Hit, HitBB, MissBB);
+
+    B.SetInsertPoint(HitBB);
+    emitIncrement(B, Hits);
+    B.CreateRet(B.CreateLoad(ResultPtr));
+
+    // The slot is filled only once the call returns; recursive calls may
+    // have used it in the meantime.
+    B.SetInsertPoint(MissBB);
+    emitIncrement(B, Misses);
+    llvm::Value *Result = B.CreateCall(Impl, Args);
+    B.CreateStore(Generation, ValidPtr);
+    for (unsigned i = 0; i != NumArgs; ++i)
+        B.CreateStore(Keys[i], KeyPtrs[i]);
+    B.CreateStore(Result, ResultPtr);
+    B.CreateRet(Result);
+
+    return Impl;
+}
+
+void ForgetMemoizedResults(llvm::StringRef Name, bool WasPure,
+                           bool IsPure) {
+    // The old definition's code can't run again: no JIT'd code runs while a
+    // definition is compiled, and once it is added the stub calls the new
+    // one.
+    Memoized.erase(std::remove_if(Memoized.begin(), Memoized.end(),
+                                  [&](const std::unique_ptr<MemoInfo> &Info) {
+                                      return Info->Name == Name;
+                                  }),
+                   Memoized.end());
+    if (!WasPure)
+        return;
+
+    // Any table may hold results that called the old definition. If the new
+    // one isn't pure, functions calling it aren't either, and which ones do
+    // isn't tracked, so every table is turned off.
+    for (auto &Info : Memoized)
+        Info->Generation =
+                IsPure && Info->Generation ? Info->Generation + 1 : 0;
+}
+
+void PrintMemoStats(llvm::raw_ostream &OS) {
+    OS << llvm::left_justify("function", 24)
+       << llvm::right_justify("hits", 14) << llvm::right_justify("misses", 14)
+       << llvm::right_justify("hit rate", 10) << "\n";
+    for (auto &Info : Memoized) {
+        uint64_t Calls = Info->Hits + Info->Misses;
+        double Rate = Calls ? 100.0 * Info->Hits / Calls : 0.0;
+        OS << llvm::left_justify(Info->Name, 24)
+           << llvm::format("%14llu", (unsigned long long)Info->Hits)
+           << llvm::format("%14llu", (unsigned long long)Info->Misses)
+           << llvm::format("%9.1f%%", Rate) << "\n";
+    }
+}
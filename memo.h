@@ -0,0 +1,36 @@
+#ifndef KALEIDOSCOPE_MEMO_H
+#define KALEIDOSCOPE_MEMO_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Function.h"
+#include "llvm/Support/raw_ostream.h"
+
+// ========================================================================
+// Memoization
+// ========================================================================
+//
+// A memoized function keeps its recent results in a direct-mapped table of
+// Entries slots, each holding the bit patterns of one set of arguments and
+// the result. A call whose arguments hash to a slot holding exactly them
+// returns the stored result; any other call computes it and overwrites the
+// slot, so the table never grows.
+
+// Moves F's body into a new internal function and makes F a wrapper that
+// consults the table before calling it. Recursive calls in the body still
+// go through F and so hit the table too. Under the JIT the table and its
+// hit counters are kept in the compiler, for PrintMemoStats(); otherwise
+// they are globals in F's module, with the counters exported as
+// "<name>.memo.hits" and "<name>.memo.misses". Returns the new function.
+llvm::Function *MemoizeFunction(llvm::Function &F, unsigned Entries);
+
+// Called under the JIT when a definition of Name is about to replace any
+// earlier one. Frees Name's old table, and if the old definition was pure,
+// empties every other table, or turns them all off if the new definition
+// isn't pure.
+void ForgetMemoizedResults(llvm::StringRef Name, bool WasPure, bool IsPure);
+
+// Prints the hits, misses and hit rate of every live function memoized
+// under the JIT.
+void PrintMemoStats(llvm::raw_ostream &OS);
+
+#endif // KALEIDOSCOPE_MEMO_H
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+
+#include "objcache.h"
+#include "target.h"
+
+// ========================================================================
+// On-disk object cache
+// ========================================================================
+
+const char *const DiskObjectCache::NoCacheFlag = "kaleidoscope.nocache";
+
+DiskObjectCache::DiskObjectCache(llvm::StringRef Dir, uint64_t MaxBytes,
+                                 const llvm::TargetMachine &TM,
+                                 unsigned OptLevel)
+    : Dir(Dir), MaxBytes(MaxBytes) {
+  Salt = getTargetKey(TM) + '\0' + std::to_string(OptLevel);
+
+  if (std::error_code EC = llvm::sys::fs::create_directories(Dir))
+    llvm::errs() << "Could not create object cache " << Dir << ": "
+                 << EC.message() << "\n";
+  TotalBytes = scan();
+}
+
+bool DiskObjectCache::getPath(const llvm::Module &M, std::string &Path) {
+  if (M.getModuleFlag(NoCacheFlag))
+    return false;
+
+  llvm::SmallVector<char, 4096> Bitcode;
+  {
+    llvm::raw_svector_ostream OS(Bitcode);
+    llvm::WriteBitcodeToFile(&M, OS);
+  }
+
+  llvm::MD5 Hash;
+  Hash.update(Salt);
+  Hash.update(llvm::StringRef(Bitcode.data(), Bitcode.size()));
+  llvm::MD5::MD5Result Result;
+  Hash.final(Result);
+  llvm::SmallString<32> Hex;
+  llvm::MD5::stringifyResult(Result, Hex);
+
+  llvm::SmallString<128> P(Dir);
+  llvm::sys::path::append(P, Hex + ".o");
+  Path = P.str().str();
+  return true;
+}
+
+std::unique_ptr<llvm::MemoryBuffer>
+DiskObjectCache::getObject(const llvm::Module *M) {
+  // The layer frees each module once it is compiled, so a later module may
+  // reuse the address; only a miss followed by a store may use the path.
+  LastModule = nullptr;
+  LastPath.clear();
+
+  std::string Path;
+  if (!getPath(*M, Path))
+    return nullptr;
+
+  auto BufOrErr = llvm::MemoryBuffer::getFile(Path, -1, false);
+  if (!BufOrErr) {
+    ++Misses;
+    LastModule = M;
+    LastPath = std::move(Path);
+    return nullptr;
+  }
+
+  // Recency for eviction is the file's modification time.
+  int FD;
+  if (!llvm::sys::fs::openFileForRead(Path, FD)) {
+    llvm::sys::fs::setLastModificationAndAccessTime(
+        FD, std::chrono::system_clock::now());
+    llvm::sys::Process::SafelyCloseFileDescriptor(FD);
+  }
+
+  ++Hits;
+  return std::move(*BufOrErr);
+}
+
+void DiskObjectCache::notifyObjectCompiled(const llvm::Module *M,
+                                           llvm::MemoryBufferRef Obj) {
+  if (M->getModuleFlag(NoCacheFlag))
+    return;
+
+  std::string Path;
+  if (M == LastModule)
+    Path = std::move(LastPath);
+  else if (!getPath(*M, Path))
+    return;
+  LastModule = nullptr;
+
+  // Write under a unique name and rename into place, so a concurrent process
+  // never maps a partly written object.
+  int FD;
+  llvm::SmallString<128> TmpPath;
+  if (llvm::sys::fs::createUniqueFile(Dir + "/tmp-%%%%%%%%.o", FD, TmpPath))
+    return;
+  {
+    llvm::raw_fd_ostream OS(FD, true);
+    OS << Obj.getBuffer();
+  }
+  if (llvm::sys::fs::rename(TmpPath, Path)) {
+    llvm::sys::fs::remove(TmpPath);
+    return;
+  }
+
+  ++Stores;
+  TotalBytes += Obj.getBufferSize();
+  if (TotalBytes > MaxBytes)
+    prune();
+}
+
+uint64_t DiskObjectCache::scan() {
+  uint64_t Bytes = 0;
+  std::error_code EC;
+  for (llvm::sys::fs::directory_iterator I(Dir, EC), E; I != E && !EC;
+       I.increment(EC)) {
+    llvm::sys::fs::file_status Status;
+    if (!I->status(Status))
+      Bytes += Status.getSize();
+  }
+  return Bytes;
+}
+
+void DiskObjectCache::prune() {
+  struct Entry {
+    std::string Path;
+    llvm::sys::TimePoint<> Time;
+    uint64_t Size;
+  };
+  std::vector<Entry> Entries;
+
+  uint64_t Bytes = 0;
+  std::error_code EC;
+  for (llvm::sys::fs::directory_iterator I(Dir, EC), E; I != E && !EC;
+       I.increment(EC)) {
+    llvm::sys::fs::file_status Status;
+    if (I->status(Status))
+      continue;
+    Entries.push_back(
+        {I->path(), Status.getLastModificationTime(), Status.getSize()});
+    Bytes += Status.getSize();
+  }
+
+  std::sort(Entries.begin(), Entries.end(),
+            [](const Entry &A, const Entry &B) { return A.Time < B.Time; });
+
+  // Evict down to three quarters of the limit so that the next few stores
+  // don't each trigger another scan.
+  uint64_t Target = MaxBytes / 4 * 3;
+  for (auto &En : Entries) {
+    if (Bytes <= Target)
+      break;
+    if (llvm::sys::fs::remove(En.Path))
+      continue;
+    Bytes -= En.Size;
+    ++Evictions;
+  }
+  TotalBytes = Bytes;
+}
+
+void DiskObjectCache::printStats(llvm::raw_ostream &OS) const {
+  OS << "Object cache: " << Hits << " hits, " << Misses << " misses, "
+     << Stores << " stored, " << Evictions << " evicted, " << TotalBytes
+     << " bytes in " << Dir << "\n";
+}
@@ -0,0 +1,59 @@
+#ifndef KALEIDOSCOPE_OBJCACHE_H
+#define KALEIDOSCOPE_OBJCACHE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+// ========================================================================
+// On-disk object cache
+// ========================================================================
+
+// Keeps the object code of compiled modules in a directory, one file per
+// module named by a hash of the module's bitcode, the target settings and
+// optimization levels. When the directory grows past its size
+// limit the least recently used objects are deleted.
+//
+// Modules carrying the NoCacheFlag module flag, such as ones with host
+// addresses baked in, are never stored or looked up.
+class DiskObjectCache : public llvm::ObjectCache {
+  std::string Dir;
+  std::string Salt;
+  uint64_t MaxBytes;
+  uint64_t TotalBytes = 0;
+
+  unsigned Hits = 0;
+  unsigned Misses = 0;
+  unsigned Stores = 0;
+  unsigned Evictions = 0;
+
+  // The compile layer asks for each module before compiling it, so a miss is
+  // followed by a store of the same module; this saves hashing it twice.
+  const llvm::Module *LastModule = nullptr;
+  std::string LastPath;
+
+  bool getPath(const llvm::Module &M, std::string &Path);
+  uint64_t scan();
+  void prune();
+
+public:
+  static const char *const NoCacheFlag;
+
+  DiskObjectCache(llvm::StringRef Dir, uint64_t MaxBytes,
+                  const llvm::TargetMachine &TM, unsigned OptLevel);
+
+  void notifyObjectCompiled(const llvm::Module *M,
+                            llvm::MemoryBufferRef Obj) override;
+  std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override;
+
+  void printStats(llvm::raw_ostream &OS) const;
+};
+
+#endif // KALEIDOSCOPE_OBJCACHE_H
@@ -1,11 +1,14 @@
+#include <algorithm>
 #include <cctype>
 #include <map>
 #include <string>
 #include <vector>
 
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
 
 #include "ast.h"
+#include "lexer.h"
 #include "log.h"
 #include "parser.h"
 
@@ -17,105 +20,77 @@ class NumberExprAST;
 class VariableExprAST;
 
 // ========================================================================
-// Lexer (token generation)
+// Parser
 // ========================================================================
 
-std::map<char, int> BinopPrecedence;
-int CurTok;
-
-static std::string IdentifierStr;
-static double NumVal;
-
-static std::unique_ptr<ExprAST> ParseExpression();
-
-static int gettok() {
-    static int LastChar = ' ';
-
-    while (std::isspace(LastChar))
-        LastChar = getchar();
-
-    if (std::isalpha(LastChar)) {
-        IdentifierStr = LastChar;
-        while (std::isalnum(LastChar = getchar()))
-            IdentifierStr += LastChar;
-
-        if (IdentifierStr == "def")
-            return tok_def;
-        if (IdentifierStr == "extern")
-            return tok_extern;
-        if (IdentifierStr == "if")
-            return tok_if;
-        if (IdentifierStr == "then")
-            return tok_then;
-        if (IdentifierStr == "else")
-            return tok_else;
-        if (IdentifierStr == "for")
-            return tok_for;
-        if (IdentifierStr == "in")
-            return tok_in;
-        if (IdentifierStr == "binary")
-            return tok_binary;
-        if (IdentifierStr == "unary")
-            return tok_unary;
-        if (IdentifierStr == "var")
-            return tok_var;
-
-        return tok_identifier;
-    }
-
-    if (std::isdigit(LastChar) || LastChar == '.') {
-        std::string NumStr;
-        do {
-            NumStr += LastChar;
-            LastChar = getchar();
-        } while (std::isdigit(LastChar) || LastChar == '.');
-
-        NumVal = std::strtod(NumStr.c_str(), nullptr);
-        return tok_number;
-    }
+void Parser::InitializeLexer(std::unique_ptr<InputSource> Source) {
+    TheLexer = llvm::make_unique<Lexer>(std::move(Source), Names);
+}
 
-    if (LastChar == '#') {
-        do {
-            LastChar = getchar();
-        } while (LastChar != EOF && LastChar != '\n' && LastChar != '\r');
-        if (LastChar != EOF) {
-            return gettok();
-        }
-    }
+bool Parser::InitializeTokenBuffer(std::unique_ptr<llvm::MemoryBuffer> Buffer,
+                                   unsigned NumThreads) {
+    TheLexer.reset();
+    TokenSource = std::move(Buffer);
+    TokPos = 0;
+    return lexAll(TokenSource->getBuffer(), Tokens, Names, NumThreads);
+}
 
-    if (LastChar == EOF) {
-        return tok_eof;
+int Parser::getNextToken() {
+    if (TheLexer) {
+        CurTok = TheLexer->lex();
+        IdentifierSym = TheLexer->getIdentifier();
+        NumVal = TheLexer->getNumVal();
+        return CurTok;
     }
 
-    int ThisChar = LastChar;
-    LastChar = getchar();
-    return ThisChar;
+    size_t I = TokPos;
+    // Stay on the trailing tok_eof once it's reached.
+    if (TokPos + 1 < Tokens.size())
+        ++TokPos;
+
+    CurTok = Tokens.Kinds[I];
+    if (CurTok == tok_identifier)
+        IdentifierSym = Tokens.Payloads[I];
+    else if (CurTok == tok_number)
+        NumVal = Tokens.Numbers[Tokens.Payloads[I]];
+    return CurTok;
 }
 
-// ========================================================================
-// Parser
-// ========================================================================
-
-int getNextToken() { return CurTok = gettok(); }
+int Parser::peekToken(unsigned N) {
+    assert(!TheLexer && "lookahead needs pretokenized input");
+    assert(N > 0 && "CurTok is not a lookahead token");
+    size_t I = std::min(TokPos + N - 1, Tokens.size() - 1);
+    return Tokens.Kinds[I];
+}
 
-static int GetTokPrecedence() {
-    if (!isascii(CurTok))
-        return -1;
+// Precedence of the binary operator Op: an ASCII character, or one of the
+// two-character comparisons, which bind like '<'.
+int Parser::getBinopPrecedence(int Op) const {
+    switch (Op) {
+    case tok_eq:
+    case tok_ne:
+    case tok_le:
+    case tok_ge:
+        return BinopPrecedence['<'];
+    }
+    return isascii(Op) ? BinopPrecedence[Op] : 0;
+}
 
-    int TokPrec = BinopPrecedence[CurTok];
+int Parser::GetTokPrecedence() {
+    int TokPrec = getBinopPrecedence(CurTok);
     if (TokPrec <= 0)
         return -1;
 
     return TokPrec;
 }
 
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-    auto Result = llvm::make_unique<NumberExprAST>(NumVal);
+ExprAST *Parser::ParseNumberExpr() {
+    auto Result = Arena.make<NumberExprAST>(NumVal);
     getNextToken();
-    return std::move(Result);
+    return Result;
 }
 
-static std::unique_ptr<ExprAST> ParseParenExpr() {
+ExprAST *Parser::ParseParenExpr() {
     getNextToken();
     auto V = ParseExpression();
     if (!V)
@@ -128,20 +103,20 @@ static std::unique_ptr<ExprAST> ParseParenExpr() {
     return V;
 }
 
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-    std::string IdName = IdentifierStr;
+ExprAST *Parser::ParseIdentifierExpr() {
+    SymbolID IdName = IdentifierSym;
 
     getNextToken();
 
     if (CurTok != '(')
-        return llvm::make_unique<VariableExprAST>(IdName);
+        return Arena.make<VariableExprAST>(IdName);
 
     getNextToken();
-    std::vector<std::unique_ptr<ExprAST>> Args;
+    llvm::SmallVector<ExprAST *, 8> Args;
     if (CurTok != ')') {
         while (true) {
             if (auto Arg = ParseExpression())
-                Args.push_back(std::move(Arg));
+                Args.push_back(Arg);
             else
                 return nullptr;
 
@@ -157,10 +132,11 @@ static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
 
     getNextToken();
 
-    return llvm::make_unique<CallExprAST>(IdName, std::move(Args));
+    return Arena.make<CallExprAST>(IdName,
+                                   Arena.copy(llvm::makeArrayRef(Args)));
 }
 
-static std::unique_ptr<ExprAST> ParseIfExpr() {
+ExprAST *Parser::ParseIfExpr() {
     // eat the if keyword
     getNextToken();
 
@@ -187,17 +163,16 @@ static std::unique_ptr<ExprAST> ParseIfExpr() {
     if (!Else)
         return nullptr;
 
-    return llvm::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
-                                        std::move(Else));
+    return Arena.make<IfExprAST>(Cond, Then, Else);
 }
 
-static std::unique_ptr<ExprAST> ParseForExpr() {
+ExprAST *Parser::ParseForExpr() {
     getNextToken();
 
     if (CurTok != tok_identifier)
         return LogError("expected identifier after for");
 
-    std::string IdName = IdentifierStr;
+    SymbolID IdName = IdentifierSym;
     // eat the identifier
     getNextToken();
 
@@ -216,7 +191,7 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
     if (!End)
         return nullptr;
 
-    std::unique_ptr<ExprAST> Step;
+    ExprAST *Step = nullptr;
     if (CurTok == ',') {
         getNextToken();
         Step = ParseExpression();
@@ -232,24 +207,23 @@ static std::unique_ptr<ExprAST> ParseForExpr() {
     if (!Body)
         return nullptr;
 
-    return llvm::make_unique<ForExprAST>(IdName, std::move(Start), std::move(End),
-                                         std::move(Step), std::move(Body));
+    return Arena.make<ForExprAST>(IdName, Start, End, Step, Body);
 }
 
-static std::unique_ptr<ExprAST> ParseVarExpr() {
+ExprAST *Parser::ParseVarExpr() {
     getNextToken();
 
-    std::vector<std::pair<std::string, std::unique_ptr<ExprAST>>> VarNames;
+    llvm::SmallVector<std::pair<SymbolID, ExprAST *>, 4> VarNames;
 
     if(CurTok != tok_identifier)
         return LogError("expected identifier after var");
 
     while (1) {
-        std::string Name = IdentifierStr;
+        SymbolID Name = IdentifierSym;
 
         getNextToken();
 
-        std::unique_ptr<ExprAST> Init;
+        ExprAST *Init = nullptr;
         if(CurTok == '=') {
             getNextToken();
 
@@ -257,7 +231,7 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
             if(!Init) return nullptr;
         }
 
-        VarNames.push_back(std::make_pair(Name, std::move(Init)));
+        VarNames.push_back(std::make_pair(Name, Init));
 
         if(CurTok != ',') break;
 
@@ -276,10 +250,11 @@ static std::unique_ptr<ExprAST> ParseVarExpr() {
     if(!Body)
         return nullptr;
 
-    return llvm::make_unique<VarExprAST>(std::move(VarNames), std::move(Body));
+    return Arena.make<VarExprAST>(Arena.copy(llvm::makeArrayRef(VarNames)),
+                                  Body);
 }
 
-static std::unique_ptr<ExprAST> ParsePrimary() {
+ExprAST *Parser::ParsePrimary() {
     std::string error("unknown token '" + std::to_string(CurTok) +
                                         "' when expecting an expression");
     switch (CurTok) {
@@ -300,52 +275,66 @@ static std::unique_ptr<ExprAST> ParsePrimary() {
     }
 }
 
-static std::unique_ptr<ExprAST> ParseUnary() {
-    if (!isascii(CurTok) || CurTok == '(' || CurTok == ',')
-        return ParsePrimary();
+ExprAST *Parser::ParseUnary() {
+    llvm::SmallVector<int, 4> Opcodes;
+    while (isascii(CurTok) && CurTok != '(' && CurTok != ',') {
+        Opcodes.push_back(CurTok);
+        getNextToken();
+    }
 
-    int Opc = CurTok;
-    getNextToken();
-    if (auto Operand = ParseUnary())
-        return llvm::make_unique<UnaryExprAST>(Opc, std::move(Operand));
-    return nullptr;
+    ExprAST *Operand = ParsePrimary();
+    if (!Operand)
+        return nullptr;
+
+    while (!Opcodes.empty())
+        Operand = Arena.make<UnaryExprAST>(Opcodes.pop_back_val(), Operand);
+    return Operand;
 }
 
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec,
-                                              std::unique_ptr<ExprAST> LHS) {
+// Precedence climbing with explicit operand and operator stacks, so that
+// neither the parse nor its stack depth grows with the number of terms.
+ExprAST *Parser::ParseExpression() {
+    llvm::SmallVector<ExprAST *, 16> Operands;
+    llvm::SmallVector<int, 16> Operators;
+
+    auto LHS = ParseUnary();
+    if (!LHS)
+        return nullptr;
+    Operands.push_back(LHS);
+
     while (true) {
         int TokPrec = GetTokPrecedence();
-        if (TokPrec < ExprPrec)
-            return LHS;
 
-        int BinOp = CurTok;
+        // Fold every pending operator that binds at least as tightly as the
+        // next one; all of them once the expression ends.
+        while (!Operators.empty()) {
+            int TopPrec = getBinopPrecedence(Operators.back());
+            if (TokPrec > TopPrec ||
+                (TokPrec == TopPrec && isascii(CurTok) &&
+                 BinopRightAssoc[CurTok]))
+                break;
+
+            ExprAST *RHS = Operands.pop_back_val();
+            ExprAST *LHS = Operands.pop_back_val();
+            Operands.push_back(Arena.make<BinaryExprAST>(
+                    Operators.pop_back_val(), LHS, RHS));
+        }
+
+        if (TokPrec < 0)
+            return Operands.back();
+
+        Operators.push_back(CurTok);
         getNextToken();
 
         auto RHS = ParseUnary();
         if (!RHS)
             return nullptr;
-
-        int NextPrec = GetTokPrecedence();
-        if (TokPrec < NextPrec) {
-            RHS = ParseBinOpRHS(TokPrec + 1, std::move(RHS));
-            if (!RHS)
-                return nullptr;
-        }
-
-        LHS = llvm::make_unique<BinaryExprAST>(BinOp, std::move(LHS), std::move(RHS));
+        Operands.push_back(RHS);
     }
 }
 
-static std::unique_ptr<ExprAST> ParseExpression() {
-    auto LHS = ParseUnary();
-    if (!LHS)
-        return nullptr;
-
-    return ParseBinOpRHS(0, std::move(LHS));
-}
-
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
-    std::string FnName;
+PrototypeAST *Parser::ParsePrototype() {
+    SymbolID FnName;
 
     unsigned Kind = 0;
     unsigned BinaryPrecedence = 30;
@@ -354,7 +343,7 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     default:
         return LogErrorP("Expected function name in prototype");
     case tok_identifier:
-        FnName = IdentifierStr;
+        FnName = IdentifierSym;
         Kind = 0;
         getNextToken();
         break;
@@ -362,8 +351,7 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
         getNextToken();
         if (!isascii(CurTok))
             return LogErrorP("Expected unary operator");
-        FnName = "unary";
-        FnName += (char)CurTok;
+        FnName = Names.intern(std::string("unary") + (char)CurTok);
         Kind = 1;
         getNextToken();
         break;
@@ -371,8 +359,11 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
         getNextToken();
         if (!isascii(CurTok))
             return LogErrorP("Expected binary operation");
-        FnName = "binary";
-        FnName += (char)CurTok;
+        // Uses of these never call a definition, so reject it before its
+        // precedence replaces the builtin one.
+        if (isBuiltinBinaryOp(CurTok))
+            return LogErrorP("Builtin binary operator can't be redefined");
+        FnName = Names.intern(std::string("binary") + (char)CurTok);
         Kind = 2;
         getNextToken();
 
@@ -388,9 +379,9 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     if (CurTok != '(')
         return LogErrorP("Expected '(' in prototype");
 
-    std::vector<std::string> ArgNames;
+    llvm::SmallVector<SymbolID, 8> ArgNames;
     while (getNextToken() == tok_identifier)
-        ArgNames.push_back(IdentifierStr);
+        ArgNames.push_back(IdentifierSym);
 
     if (CurTok != ')')
         return LogErrorP("Exptected ')' in prototype");
@@ -400,33 +391,34 @@ static std::unique_ptr<PrototypeAST> ParsePrototype() {
     if (Kind && ArgNames.size() != Kind)
         return LogErrorP("Invalid number of operands for operator");
 
-    return llvm::make_unique<PrototypeAST>(FnName, std::move(ArgNames), Kind != 0,
-                                           BinaryPrecedence);
+    return Arena.make<PrototypeAST>(
+            FnName, Arena.copy(llvm::makeArrayRef(ArgNames)), Kind != 0,
+            BinaryPrecedence);
 }
 
-std::unique_ptr<FunctionAST> ParseDefinition() {
+FunctionAST *Parser::ParseDefinition() {
     getNextToken();
     auto Proto = ParsePrototype();
     if (!Proto)
         return nullptr;
 
     if (auto E = ParseExpression())
-        return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+        return Arena.make<FunctionAST>(Proto, E);
 
     return nullptr;
 }
 
-std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
+FunctionAST *Parser::ParseTopLevelExpr() {
     if (auto E = ParseExpression()) {
-        auto Proto = llvm::make_unique<PrototypeAST>("__anon_expr",
-                                                     std::vector<std::string>());
+        auto Proto = Arena.make<PrototypeAST>(
+                Names.intern("__anon_expr"), llvm::ArrayRef<SymbolID>());
 
-        return llvm::make_unique<FunctionAST>(std::move(Proto), std::move(E));
+        return Arena.make<FunctionAST>(Proto, E);
     }
     return nullptr;
 }
 
-std::unique_ptr<PrototypeAST> ParseExtern() {
+PrototypeAST *Parser::ParseExtern() {
     getNextToken();
     return ParsePrototype();
 }
@@ -1,43 +1,71 @@
 #ifndef KALEIDOSCOPE_PARSER_H
 #define KALEIDOSCOPE_PARSER_H
 
-#include <map>
 #include <memory>
 #include <string>
 
+#include "lexer.h"
+
 // Forward declarations
+class ASTArena;
 class ExprAST;
 class FunctionAST;
 class PrototypeAST;
 
-enum Token {
-  tok_eof = -1,
-
-  tok_def = -2,
-  tok_extern = -3,
+// ========================================================================
+// Parser
+// ========================================================================
 
-  tok_identifier = -4,
-  tok_number = -5,
+// Parses the input of one CompilerInstance into AST nodes allocated from its
+// arena, interning identifiers into its Interner.
+class Parser {
+public:
+    // Binary operator precedence (0 if the character is not a binary operator)
+    // and associativity, indexed by operator character.
+    int BinopPrecedence[256] = {};
+    bool BinopRightAssoc[256] = {};
+    int CurTok = 0;
 
-  tok_if = -6,
-  tok_then = -7,
-  tok_else = -8,
+    Parser(Interner &Names, ASTArena &Arena) : Names(Names), Arena(Arena) {}
 
-  tok_for = -9,
-  tok_in = -10,
+    void InitializeLexer(std::unique_ptr<InputSource> Source);
+    // Tokenizes all of Buffer up front; getNextToken() then walks the token
+    // array instead of lexing on demand.
+    bool InitializeTokenBuffer(std::unique_ptr<llvm::MemoryBuffer> Buffer,
+                               unsigned NumThreads);
+    int getNextToken();
+    // Kind of the token N positions past CurTok. Pretokenized input only.
+    int peekToken(unsigned N = 1);
+    FunctionAST *ParseDefinition();
+    PrototypeAST *ParseExtern();
+    FunctionAST *ParseTopLevelExpr();
 
-  tok_binary = -11,
-  tok_unary = -12,
+private:
+    Interner &Names;
+    ASTArena &Arena;
 
-  tok_var = -13
-};
+    std::unique_ptr<Lexer> TheLexer;
+    SymbolID IdentifierSym = 0;
+    double NumVal = 0;
 
-extern std::map<char, int> BinopPrecedence;
-extern int CurTok;
+    // Pretokenized input: the whole source and its tokens, with TokPos
+    // indexing the token after CurTok.
+    std::unique_ptr<llvm::MemoryBuffer> TokenSource;
+    TokenBuffer Tokens;
+    size_t TokPos = 0;
 
-int getNextToken();
-std::unique_ptr<FunctionAST> ParseDefinition();
-std::unique_ptr<PrototypeAST> ParseExtern();
-std::unique_ptr<FunctionAST> ParseTopLevelExpr();
+    int getBinopPrecedence(int Op) const;
+    int GetTokPrecedence();
+    ExprAST *ParseNumberExpr();
+    ExprAST *ParseParenExpr();
+    ExprAST *ParseIdentifierExpr();
+    ExprAST *ParseIfExpr();
+    ExprAST *ParseForExpr();
+    ExprAST *ParseVarExpr();
+    ExprAST *ParsePrimary();
+    ExprAST *ParseUnary();
+    ExprAST *ParseExpression();
+    PrototypeAST *ParsePrototype();
+};
 
 #endif // KALEIDOSCOPE_PARSER_H
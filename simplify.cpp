@@ -0,0 +1,233 @@
+#include <cmath>
+#include <utility>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include "ast.h"
+#include "compiler.h"
+#include "eval.h"
+#include "jit.h"
+#include "simplify.h"
+
+// ========================================================================
+// AST simplification
+// ========================================================================
+
+static bool getConstant(ExprAST *E, double &Val) {
+    auto *N = llvm::dyn_cast<NumberExprAST>(E);
+    if (!N)
+        return false;
+    Val = N->getVal();
+    return true;
+}
+
+static bool isConstant(ExprAST *E, double Val) {
+    double V;
+    return getConstant(E, V) && V == Val &&
+           std::signbit(V) == std::signbit(Val);
+}
+
+namespace {
+class Simplifier {
+    ASTArena &A;
+    // The function being simplified. Calls to it mean the definition being
+    // compiled, so they can't be evaluated yet.
+    SymbolID Self;
+    // Shared by every call evaluated in the item, so one that never
+    // finishes costs its steps once, not at each call site.
+    uint64_t Budget;
+
+    ExprAST *simplifyBinary(BinaryExprAST *B, ExprAST *L, ExprAST *R);
+    ExprAST *evaluate(SymbolID Callee, llvm::ArrayRef<ExprAST *> Args);
+
+public:
+    Simplifier(ASTArena &A, SymbolID Self, uint64_t Budget)
+            : A(A), Self(Self), Budget(Budget) {}
+
+    ExprAST *simplify(ExprAST *E);
+};
+} // end anonymous namespace
+
+// A literal for the result of calling Callee with Args if they are all
+// constants and the call can be evaluated, otherwise null. Under the JIT the
+// callee may be redefined later, and a literal wouldn't follow it.
+ExprAST *Simplifier::evaluate(SymbolID Callee,
+                              llvm::ArrayRef<ExprAST *> Args) {
+    if (!Budget || TheJIT)
+        return nullptr;
+
+    llvm::SmallVector<double, 8> Vals;
+    for (ExprAST *Arg : Args) {
+        Vals.push_back(0.0);
+        if (!getConstant(Arg, Vals.back()))
+            return nullptr;
+    }
+
+    double Result;
+    if (!evaluateCall(Callee, Vals, Self, Budget, Result))
+        return nullptr;
+    return A.make<NumberExprAST>(Result);
+}
+
+// The simplest form of "L Op R" given simplified operands, reusing B if
+// nothing changed.
+ExprAST *Simplifier::simplifyBinary(BinaryExprAST *B, ExprAST *L,
+                                    ExprAST *R) {
+    int Op = B->getOp();
+    double LV, RV, Result;
+    bool LConst = getConstant(L, LV), RConst = getConstant(R, RV);
+
+    if (LConst && RConst) {
+        if (evaluateBuiltinBinary(Op, LV, RV, Result))
+            return A.make<NumberExprAST>(Result);
+        ExprAST *Operands[2] = {L, R};
+        if (!isBuiltinBinaryOp(Op))
+            if (ExprAST *Folded = evaluate(getBinaryOpSymbol(Op), Operands))
+                return Folded;
+    }
+
+    // A constant left side can decide '&' and '|' alone; the right side is
+    // never evaluated then. Otherwise the result is the truth of the right
+    // side, which needs the operator to convert it.
+    if (LConst && Op == '&' && !isTrue(LV))
+        return A.make<NumberExprAST>(0.0);
+    if (LConst && Op == '|' && isTrue(LV))
+        return A.make<NumberExprAST>(1.0);
+
+    // Identities exact for every double, NaNs and signed zeros included.
+    switch (Op) {
+    case '*':
+        if (isConstant(R, 1.0))
+            return L;
+        if (isConstant(L, 1.0))
+            return R;
+        break;
+    case '-':
+        if (isConstant(R, 0.0))
+            return L;
+        break;
+    case '+':
+        if (isConstant(R, -0.0))
+            return L;
+        if (isConstant(L, -0.0))
+            return R;
+        break;
+    }
+
+    if (L == B->getLHS() && R == B->getRHS())
+        return B;
+    return A.make<BinaryExprAST>(Op, L, R);
+}
+
+ExprAST *Simplifier::simplify(ExprAST *E) {
+    if (!E)
+        return nullptr;
+
+    switch (E->getKind()) {
+    case ExprAST::EK_Number:
+    case ExprAST::EK_Variable:
+        return E;
+
+    case ExprAST::EK_Binary: {
+        auto *B = llvm::cast<BinaryExprAST>(E);
+        if (B->getOp() == '=') {
+            ExprAST *R = simplify(B->getRHS());
+            if (R == B->getRHS())
+                return B;
+            return A.make<BinaryExprAST>('=', B->getLHS(), R);
+        }
+
+        // As in codegen, walk chains like a+b+c+... down the left operand
+        // with a loop so the depth doesn't grow with their length.
+        llvm::SmallVector<BinaryExprAST *, 16> Spine;
+        while (true) {
+            Spine.push_back(B);
+            auto *Next = llvm::dyn_cast<BinaryExprAST>(B->getLHS());
+            if (!Next || Next->getOp() == '=')
+                break;
+            B = Next;
+        }
+
+        ExprAST *L = simplify(Spine.back()->getLHS());
+        for (auto I = Spine.rbegin(), IE = Spine.rend(); I != IE; ++I)
+            L = simplifyBinary(*I, L, simplify((*I)->getRHS()));
+        return L;
+    }
+
+    case ExprAST::EK_Unary: {
+        auto *U = llvm::cast<UnaryExprAST>(E);
+        ExprAST *Operand = simplify(U->getOperand());
+        if (ExprAST *Folded = evaluate(getUnaryOpSymbol(U->getOpcode()),
+                                       Operand))
+            return Folded;
+        if (Operand == U->getOperand())
+            return U;
+        return A.make<UnaryExprAST>(U->getOpcode(), Operand);
+    }
+
+    case ExprAST::EK_Call: {
+        auto *C = llvm::cast<CallExprAST>(E);
+        llvm::SmallVector<ExprAST *, 8> Args;
+        bool Changed = false;
+        for (ExprAST *Arg : C->getArgs()) {
+            Args.push_back(simplify(Arg));
+            Changed |= Args.back() != Arg;
+        }
+        if (ExprAST *Folded = evaluate(C->getCallee(), Args))
+            return Folded;
+        if (!Changed)
+            return C;
+        return A.make<CallExprAST>(C->getCallee(),
+                                   A.copy(llvm::makeArrayRef(Args)));
+    }
+
+    case ExprAST::EK_Var: {
+        auto *V = llvm::cast<VarExprAST>(E);
+        llvm::SmallVector<std::pair<SymbolID, ExprAST *>, 4> Vars;
+        bool Changed = false;
+        for (auto &Var : V->getVarNames()) {
+            Vars.push_back(
+                    std::make_pair(Var.first, simplify(Var.second)));
+            Changed |= Vars.back().second != Var.second;
+        }
+        ExprAST *Body = simplify(V->getBody());
+        if (!Changed && Body == V->getBody())
+            return V;
+        return A.make<VarExprAST>(A.copy(llvm::makeArrayRef(Vars)), Body);
+    }
+
+    case ExprAST::EK_If: {
+        auto *I = llvm::cast<IfExprAST>(E);
+        ExprAST *Cond = simplify(I->getCond());
+        double CondVal;
+        if (getConstant(Cond, CondVal))
+            return simplify(isTrue(CondVal) ? I->getThen() : I->getElse());
+
+        ExprAST *Then = simplify(I->getThen());
+        ExprAST *Else = simplify(I->getElse());
+        if (Cond == I->getCond() && Then == I->getThen() &&
+            Else == I->getElse())
+            return I;
+        return A.make<IfExprAST>(Cond, Then, Else);
+    }
+
+    case ExprAST::EK_For: {
+        auto *F = llvm::cast<ForExprAST>(E);
+        ExprAST *Start = simplify(F->getStart());
+        ExprAST *End = simplify(F->getEnd());
+        ExprAST *Step = simplify(F->getStep());
+        ExprAST *Body = simplify(F->getBody());
+        if (Start == F->getStart() && End == F->getEnd() &&
+            Step == F->getStep() && Body == F->getBody())
+            return F;
+        return A.make<ForExprAST>(F->getVarName(), Start, End, Step, Body);
+    }
+    }
+    llvm_unreachable("unknown expression kind");
+}
+
+void simplifyFunction(ASTArena &A, FunctionAST &F) {
+    Simplifier S(A, F.getProto()->getName(), TheCompiler->EvalBudget);
+    F.setBody(S.simplify(F.getBody()));
+}
@@ -0,0 +1,19 @@
+#ifndef KALEIDOSCOPE_SIMPLIFY_H
+#define KALEIDOSCOPE_SIMPLIFY_H
+
+// Forward declarations
+class ASTArena;
+class FunctionAST;
+
+// ========================================================================
+// AST simplification
+// ========================================================================
+
+// Simplifies F's body: folds builtin arithmetic, comparisons and '&'/'|' on
+// constants, picks the taken branch of an if with a constant condition,
+// drops x*1, x-0 and x+(-0), and evaluates calls of pure functions and
+// operators with constant arguments outside the JIT, all with the results
+// the generated code would compute. Nodes that change are rebuilt in A.
+void simplifyFunction(ASTArena &A, FunctionAST &F);
+
+#endif // KALEIDOSCOPE_SIMPLIFY_H
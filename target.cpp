@@ -0,0 +1,79 @@
+#include "llvm/ADT/StringMap.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "target.h"
+
+// ========================================================================
+// Target selection
+// ========================================================================
+
+void ResolveHostCPU(TargetSettings &TS) {
+  if (TS.CPU != "native")
+    return;
+
+  TS.CPU = llvm::sys::getHostCPUName().str();
+
+  llvm::SubtargetFeatures Features;
+  llvm::StringMap<bool> HostFeatures;
+  if (llvm::sys::getHostCPUFeatures(HostFeatures))
+    for (auto &F : HostFeatures)
+      Features.AddFeature(F.first(), F.second);
+  llvm::SubtargetFeatures Explicit(TS.Features);
+  for (auto &F : Explicit.getFeatures())
+    Features.AddFeature(F);
+  TS.Features = Features.getString();
+}
+
+void ApplyFPModel(TargetSettings &TS, FPModel Model) {
+  llvm::TargetOptions &O = TS.Options;
+  bool Fast = Model == FPModel::Fast;
+  O.UnsafeFPMath = Fast;
+  O.NoInfsFPMath = Fast;
+  O.NoNaNsFPMath = Fast;
+  O.AllowFPOpFusion = Model == FPModel::Strict ? llvm::FPOpFusion::Standard
+                                               : llvm::FPOpFusion::Fast;
+}
+
+llvm::FastMathFlags getFastMathFlags(const llvm::TargetOptions &O) {
+  llvm::FastMathFlags FMF;
+  if (O.UnsafeFPMath)
+    FMF.setUnsafeAlgebra();
+  if (O.NoNaNsFPMath)
+    FMF.setNoNaNs();
+  if (O.NoInfsFPMath)
+    FMF.setNoInfs();
+  return FMF;
+}
+
+std::unique_ptr<llvm::TargetMachine>
+CreateTargetMachine(const TargetSettings &TS, unsigned Level) {
+  static const llvm::CodeGenOpt::Level CodeGenLevels[] = {
+      llvm::CodeGenOpt::None, llvm::CodeGenOpt::Less,
+      llvm::CodeGenOpt::Default, llvm::CodeGenOpt::Aggressive};
+
+  std::string Error;
+  auto Target = llvm::TargetRegistry::lookupTarget(TS.Triple, Error);
+  if (!Target) {
+    llvm::errs() << Error << "\n";
+    return nullptr;
+  }
+
+  return std::unique_ptr<llvm::TargetMachine>(Target->createTargetMachine(
+      TS.Triple, TS.CPU, TS.Features, TS.Options, TS.RM, TS.CM,
+      CodeGenLevels[Level]));
+}
+
+std::string getTargetKey(const llvm::TargetMachine &TM) {
+  const llvm::TargetOptions &O = TM.Options;
+  std::string Key;
+  llvm::raw_string_ostream OS(Key);
+  OS << TM.getTargetTriple().str() << '\0' << TM.getTargetCPU() << '\0'
+     << TM.getTargetFeatureString() << '\0' << (unsigned)TM.getOptLevel()
+     << '\0' << (unsigned)TM.getRelocationModel() << '\0'
+     << (unsigned)TM.getCodeModel() << '\0' << O.UnsafeFPMath
+     << O.NoInfsFPMath << O.NoNaNsFPMath << (unsigned)O.AllowFPOpFusion;
+  return OS.str();
+}
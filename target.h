@@ -0,0 +1,61 @@
+#ifndef KALEIDOSCOPE_TARGET_H
+#define KALEIDOSCOPE_TARGET_H
+
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/Optional.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+
+// ========================================================================
+// Target selection
+// ========================================================================
+
+// Everything a TargetMachine is created from apart from the optimization
+// level, so the JIT, the background compiler and every AOT thread can each
+// make their own identical one.
+struct TargetSettings {
+  std::string Triple;
+  // "native" stands for the host CPU and its features.
+  std::string CPU = "generic";
+  // Comma-separated "+feature" / "-feature" list.
+  std::string Features;
+  llvm::TargetOptions Options;
+  llvm::Optional<llvm::Reloc::Model> RM;
+  llvm::CodeModel::Model CM = llvm::CodeModel::Default;
+};
+
+// How freely floating-point arithmetic may be rewritten.
+enum class FPModel {
+  // As written: no reassociation, and no multiply-add fusion.
+  Strict,
+  // As written, except that a*b+c may become one fused multiply-add.
+  Contract,
+  // Reassociate, approximate, fuse, and assume no NaNs or infinities.
+  Fast
+};
+
+// Sets the options of TS that the code generator reads for Model.
+void ApplyFPModel(TargetSettings &TS, FPModel Model);
+
+// The fast-math flags for IR that TargetOptions O allow the code generator
+// to assume anyway, so the optimizer may make use of them too.
+llvm::FastMathFlags getFastMathFlags(const llvm::TargetOptions &O);
+
+// Replaces a "native" CPU with the host's CPU name and puts the host's
+// features ahead of the explicit ones, which therefore win.
+void ResolveHostCPU(TargetSettings &TS);
+
+// Creates a TargetMachine for TS generating code at Level (0-3). Prints a
+// diagnostic and returns null if the triple has no registered target.
+std::unique_ptr<llvm::TargetMachine>
+CreateTargetMachine(const TargetSettings &TS, unsigned Level);
+
+// A string that differs whenever TM would generate different code for the
+// same IR, for keying caches of object code.
+std::string getTargetKey(const llvm::TargetMachine &TM);
+
+#endif // KALEIDOSCOPE_TARGET_H
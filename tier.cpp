@@ -0,0 +1,228 @@
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+#include "jit.h"
+#include "objcache.h"
+#include "tier.h"
+
+// ========================================================================
+// Tiered compilation
+// ========================================================================
+
+namespace {
+struct TierInfo {
+  std::string Name;
+  // Incremented by the baseline code on every entry.
+  uint64_t Calls = 0;
+  unsigned Tier = 0;
+  bool Superseded = false;
+  double CompileSeconds = 0;
+  // The defining module before instrumentation.
+  std::string Bitcode;
+};
+} // end anonymous namespace
+
+static bool TieringEnabled = false;
+static uint64_t TierUpThreshold;
+
+// One entry per definition ever made, indexed by the ID baked into its entry
+// counter. Guarded by TheJITMutex.
+static std::vector<std::unique_ptr<TierInfo>> Functions;
+static llvm::StringMap<unsigned> CurrentDefinition;
+
+static std::mutex QueueMutex;
+static std::condition_variable QueueReady;
+static std::deque<unsigned> HotFunctions;
+static bool ShuttingDown = false;
+
+static std::thread Worker;
+// The background thread's own TargetMachine; the JIT's may be generating code
+// at the same time.
+static std::unique_ptr<llvm::TargetMachine> WorkerTM;
+
+// Called from baseline code when a counter reaches the threshold. Must not
+// take TheJITMutex: the code calling it runs without the lock.
+static void TierUp(uint64_t ID) {
+  {
+    std::lock_guard<std::mutex> Lock(QueueMutex);
+    HotFunctions.push_back(ID);
+  }
+  QueueReady.notify_one();
+}
+
+static void InsertEntryCounter(llvm::Function &F, TierInfo &Info,
+                               unsigned ID) {
+  // Keep the allocas in the entry block, where mem2reg looks for them.
+  llvm::BasicBlock &Entry = F.getEntryBlock();
+  auto IP = Entry.begin();
+  while (llvm::isa<llvm::AllocaInst>(IP))
+    ++IP;
+
+  llvm::IRBuilder<> B(&Entry, IP);
+  llvm::Type *Int64Ty = B.getInt64Ty();
+  llvm::Constant *Counter = llvm::ConstantExpr::getIntToPtr(
+      B.getInt64((uintptr_t)&Info.Calls), Int64Ty->getPointerTo());
+  llvm::Value *Calls = B.CreateAdd(B.CreateLoad(Counter), B.getInt64(1));
+  B.CreateStore(Calls, Counter);
+  llvm::Value *Hot = B.CreateICmpEQ(Calls, B.getInt64(TierUpThreshold));
+
+  llvm::MDBuilder MDB(F.getContext());
+  llvm::TerminatorInst *Then = llvm::SplitBlockAndInsertIfThen(
+      Hot, &*IP, false, MDB.createBranchWeights(1, 1 << 20));
+
+  B.SetInsertPoint(Then);
+  llvm::FunctionType *TierUpTy =
+      llvm::FunctionType::get(B.getVoidTy(), Int64Ty, false);
+  llvm::Constant *Callee = llvm::ConstantExpr::getIntToPtr(
+      B.getInt64((uintptr_t)&TierUp), TierUpTy->getPointerTo());
+  B.CreateCall(TierUpTy, Callee, B.getInt64(ID));
+}
+
+void InstrumentForTiering(llvm::Module &M) {
+  std::string Bitcode;
+  {
+    llvm::raw_string_ostream OS(Bitcode);
+    llvm::WriteBitcodeToFile(&M, OS);
+  }
+
+  for (auto &F : M) {
+    if (F.isDeclaration() || !F.hasExternalLinkage())
+      continue;
+
+    unsigned ID = Functions.size();
+    auto Info = llvm::make_unique<TierInfo>();
+    Info->Name = F.getName().str();
+    Info->Bitcode = Bitcode;
+
+    // A queued tier-up of the old definition must not replace this one.
+    auto Prev = CurrentDefinition.find(F.getName());
+    if (Prev != CurrentDefinition.end())
+      Functions[Prev->second]->Superseded = true;
+    CurrentDefinition[F.getName()] = ID;
+
+    InsertEntryCounter(F, *Info, ID);
+    Functions.push_back(std::move(Info));
+  }
+
+  // The counters are host addresses, which differ from run to run.
+  if (!M.getModuleFlag(DiskObjectCache::NoCacheFlag))
+    M.addModuleFlag(llvm::Module::Warning, DiskObjectCache::NoCacheFlag, 1);
+}
+
+static void CompileHotFunction(unsigned ID) {
+  std::string Name, Bitcode;
+  {
+    std::lock_guard<std::mutex> Lock(TheJITMutex);
+    TierInfo &Info = *Functions[ID];
+    if (Info.Superseded)
+      return;
+    Name = Info.Name;
+    Bitcode = Info.Bitcode;
+  }
+
+  auto Start = std::chrono::steady_clock::now();
+
+  // The JIT's modules live in the main thread's CompilerInstance.
+  llvm::LLVMContext Context;
+  auto MOrErr =
+      llvm::parseBitcodeFile(llvm::MemoryBufferRef(Bitcode, Name), Context);
+  if (!MOrErr) {
+    llvm::logAllUnhandledErrors(MOrErr.takeError(), llvm::errs(),
+                                "tier-up of " + Name + ": ");
+    return;
+  }
+  std::unique_ptr<llvm::Module> M = std::move(*MOrErr);
+
+  // Only the hot function moves up; anything else defined alongside it keeps
+  // its own counter. Internal helpers, such as the body of a memoized
+  // function, can't be linked to the baseline code and stay.
+  for (auto &F : *M)
+    if (!F.isDeclaration() && F.hasExternalLinkage() && F.getName() != Name)
+      F.deleteBody();
+
+  OptimizeModuleAt(*M, *WorkerTM, 3);
+
+  std::lock_guard<std::mutex> Lock(TheJITMutex);
+  TierInfo &Info = *Functions[ID];
+  if (Info.Superseded)
+    return;
+
+  TheJIT->addDefinitions(std::move(M));
+  Info.Tier = 1;
+  std::chrono::duration<double> Elapsed =
+      std::chrono::steady_clock::now() - Start;
+  Info.CompileSeconds = Elapsed.count();
+}
+
+static void WorkerLoop() {
+  while (true) {
+    unsigned ID;
+    {
+      std::unique_lock<std::mutex> Lock(QueueMutex);
+      QueueReady.wait(Lock,
+                      [] { return ShuttingDown || !HotFunctions.empty(); });
+      if (ShuttingDown)
+        return;
+      ID = HotFunctions.front();
+      HotFunctions.pop_front();
+    }
+    CompileHotFunction(ID);
+  }
+}
+
+void InitializeTiering(uint64_t Threshold,
+                       std::unique_ptr<llvm::TargetMachine> TM) {
+  TieringEnabled = true;
+  TierUpThreshold = Threshold;
+  WorkerTM = std::move(TM);
+  // Tier-ups are added to the JIT from the worker, so their machine code is
+  // generated there at -O3 too.
+  SetPreOptimizedMachine(*WorkerTM);
+  Worker = std::thread(WorkerLoop);
+}
+
+bool isTieringEnabled() { return TieringEnabled; }
+
+void ShutdownTiering() {
+  if (!TieringEnabled)
+    return;
+
+  {
+    std::lock_guard<std::mutex> Lock(QueueMutex);
+    ShuttingDown = true;
+  }
+  QueueReady.notify_one();
+  Worker.join();
+}
+
+void PrintTierStats(llvm::raw_ostream &OS) {
+  std::lock_guard<std::mutex> Lock(TheJITMutex);
+
+  OS << llvm::left_justify("function", 24) << "  tier"
+     << llvm::right_justify("base calls", 14)
+     << llvm::right_justify("tier-up ms", 12) << "\n";
+  for (auto &Info : Functions) {
+    if (Info->Superseded)
+      continue;
+    OS << llvm::left_justify(Info->Name, 24) << "  "
+       << llvm::format("%4u", Info->Tier)
+       << llvm::format("%14llu", (unsigned long long)Info->Calls)
+       << llvm::format("%12.2f", Info->CompileSeconds * 1000) << "\n";
+  }
+}
@@ -0,0 +1,37 @@
+#ifndef KALEIDOSCOPE_TIER_H
+#define KALEIDOSCOPE_TIER_H
+
+#include <cstdint>
+#include <memory>
+
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+
+// ========================================================================
+// Tiered compilation
+// ========================================================================
+//
+// Definitions are first compiled at the JIT's baseline level with a counter
+// on entry. A function whose counter reaches the threshold is re-optimized at
+// -O3 on a background thread, from a bitcode copy of its original IR in a
+// private LLVMContext, and its stub is pointed at the new body.
+
+// Starts the background compiler, which generates code with TM. Must be
+// called after InitializeJIT().
+void InitializeTiering(uint64_t Threshold,
+                       std::unique_ptr<llvm::TargetMachine> TM);
+bool isTieringEnabled();
+// Stops the background compiler, dropping any queued tier-ups.
+void ShutdownTiering();
+
+// Records the definitions in M for later re-optimization and adds entry
+// counters to them. Call with TheJITMutex held, just before M is handed to
+// the JIT.
+void InstrumentForTiering(llvm::Module &M);
+
+// Prints the tier, baseline call count and tier-up compile time of every
+// live definition.
+void PrintTierStats(llvm::raw_ostream &OS);
+
+#endif // KALEIDOSCOPE_TIER_H